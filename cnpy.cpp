@@ -10,7 +10,183 @@
 #include<iomanip>
 #include<stdint.h>
 #include<stdexcept>
-#include <regex>
+#include<thread>
+#include<atomic>
+#include<mutex>
+#include<chrono>
+#include<unordered_map>
+#include<set>
+#include<future>
+#include<cerrno>
+#ifndef _WIN32
+#include<fcntl.h>
+#include<unistd.h>
+#include<sys/types.h>
+#include<sys/mman.h>
+#include<dirent.h>
+#else
+#include<io.h>
+#endif
+#include<sys/stat.h>
+
+namespace {
+
+//lock-free aggregation of phase timings. PhaseTimer checks one relaxed flag when metrics are off,
+//and compiles to nothing without CNPY_ENABLE_METRICS
+struct PhaseCounters {
+    static const size_t bucket_count = 64;
+    std::atomic<uint64_t> calls;
+    std::atomic<uint64_t> total_nanoseconds;
+    std::atomic<uint64_t> max_nanoseconds;
+    std::atomic<uint64_t> bytes;
+    std::atomic<uint64_t> histogram[bucket_count];
+};
+
+struct MetricsRegistry {
+    MetricsRegistry() : enabled(false), has_callback(false) { reset(); }
+
+    void reset() {
+        for(size_t p = 0; p < cnpy::PHASE_COUNT; p++) {
+            phases[p].calls = 0;
+            phases[p].total_nanoseconds = 0;
+            phases[p].max_nanoseconds = 0;
+            phases[p].bytes = 0;
+            for(size_t b = 0; b < PhaseCounters::bucket_count; b++) phases[p].histogram[b] = 0;
+        }
+    }
+
+    void record(cnpy::MetricsPhase phase, uint64_t nanoseconds, uint64_t byte_count, const char* path) {
+        PhaseCounters& counters = phases[phase];
+        counters.calls.fetch_add(1, std::memory_order_relaxed);
+        counters.total_nanoseconds.fetch_add(nanoseconds, std::memory_order_relaxed);
+        counters.bytes.fetch_add(byte_count, std::memory_order_relaxed);
+        uint64_t previous_max = counters.max_nanoseconds.load(std::memory_order_relaxed);
+        while(nanoseconds > previous_max && !counters.max_nanoseconds.compare_exchange_weak(previous_max, nanoseconds)) { }
+        size_t bucket = 0;
+        while(bucket + 1 < PhaseCounters::bucket_count && (nanoseconds >> (bucket + 1)) != 0) bucket++;
+        counters.histogram[bucket].fetch_add(1, std::memory_order_relaxed);
+
+        if(has_callback.load(std::memory_order_acquire)) {
+            std::lock_guard<std::mutex> lock(callback_mutex);
+            if(callback) {
+                cnpy::MetricsEvent event = {phase, nanoseconds, byte_count, path};
+                callback(event);
+            }
+        }
+    }
+
+    std::atomic<bool> enabled;
+    std::atomic<bool> has_callback;
+    std::mutex callback_mutex;
+    std::function<void(const cnpy::MetricsEvent&)> callback;
+    PhaseCounters phases[cnpy::PHASE_COUNT];
+};
+
+MetricsRegistry& metrics_registry() {
+    static MetricsRegistry registry;
+    return registry;
+}
+
+#ifdef CNPY_ENABLE_METRICS
+//file the current thread is working on, reported with each event
+thread_local const char* metrics_path = NULL;
+
+class MetricsPathScope {
+public:
+    explicit MetricsPathScope(const std::string& path) : previous(metrics_path) { metrics_path = path.c_str(); }
+    ~MetricsPathScope() { metrics_path = previous; }
+private:
+    const char* previous;
+};
+
+class PhaseTimer {
+public:
+    explicit PhaseTimer(cnpy::MetricsPhase phase, uint64_t byte_count = 0) :
+        phase(phase), byte_count(byte_count), active(metrics_registry().enabled.load(std::memory_order_relaxed))
+    {
+        if(active) start = std::chrono::steady_clock::now();
+    }
+
+    ~PhaseTimer() {
+        if(!active) return;
+        uint64_t nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        metrics_registry().record(phase, nanoseconds, byte_count, metrics_path);
+    }
+
+    void add_bytes(uint64_t count) { byte_count += count; }
+
+private:
+    cnpy::MetricsPhase phase;
+    uint64_t byte_count;
+    bool active;
+    std::chrono::steady_clock::time_point start;
+};
+#else
+class MetricsPathScope {
+public:
+    explicit MetricsPathScope(const std::string&) { }
+};
+
+class PhaseTimer {
+public:
+    explicit PhaseTimer(cnpy::MetricsPhase, uint64_t = 0) { }
+    void add_bytes(uint64_t) { }
+};
+#endif
+
+} // namespace
+
+void cnpy::metrics_enable(bool enabled) {
+#ifdef CNPY_ENABLE_METRICS
+    metrics_registry().enabled = enabled;
+#else
+    (void) enabled;
+#endif
+}
+
+bool cnpy::metrics_enabled() {
+    return metrics_registry().enabled;
+}
+
+void cnpy::metrics_reset() {
+    metrics_registry().reset();
+}
+
+cnpy::MetricsSnapshot cnpy::metrics_snapshot() {
+    MetricsRegistry& registry = metrics_registry();
+    MetricsSnapshot snapshot;
+    for(size_t p = 0; p < PHASE_COUNT; p++) {
+        PhaseCounters& counters = registry.phases[p];
+        snapshot.phases[p].calls = counters.calls;
+        snapshot.phases[p].total_nanoseconds = counters.total_nanoseconds;
+        snapshot.phases[p].max_nanoseconds = counters.max_nanoseconds;
+        snapshot.phases[p].bytes = counters.bytes;
+        snapshot.phases[p].latency_histogram.resize(PhaseCounters::bucket_count);
+        for(size_t b = 0; b < PhaseCounters::bucket_count; b++) snapshot.phases[p].latency_histogram[b] = counters.histogram[b];
+    }
+    return snapshot;
+}
+
+void cnpy::metrics_set_callback(std::function<void(const MetricsEvent&)> callback) {
+    MetricsRegistry& registry = metrics_registry();
+    std::lock_guard<std::mutex> lock(registry.callback_mutex);
+    registry.callback = callback;
+    registry.has_callback = (bool) callback;
+}
+
+const char* cnpy::metrics_phase_name(MetricsPhase phase) {
+    switch(phase) {
+        case PHASE_OPEN: return "open";
+        case PHASE_HEADER_PARSE: return "header_parse";
+        case PHASE_READ: return "read";
+        case PHASE_DECOMPRESS: return "decompress";
+        case PHASE_CRC: return "crc";
+        case PHASE_WRITE: return "write";
+        case PHASE_FSYNC: return "fsync";
+        case PHASE_DIRECTORY: return "directory";
+        default: return "unknown";
+    }
+}
 
 char cnpy::BigEndianTest() {
     int x = 1;
@@ -83,6 +259,58 @@ cnpy::NPY_TYPE cnpy::map_type_to_npy_types(const std::type_info& t) {
     else return NPY_NOTYPE;
 }
 
+static char map_npy_type_to_type_char(cnpy::NPY_TYPE type) {
+    using namespace cnpy;
+    switch(type) {
+        case NPY_FLOAT: case NPY_DOUBLE: case NPY_LONGDOUBLE: case NPY_HALF: return 'f';
+        case NPY_BYTE: case NPY_SHORT: case NPY_INT: case NPY_LONG: case NPY_LONGLONG: return 'i';
+        case NPY_UBYTE: case NPY_USHORT: case NPY_UINT: case NPY_ULONG: case NPY_ULONGLONG: return 'u';
+        case NPY_BOOL: return 'b';
+        case NPY_CFLOAT: case NPY_CDOUBLE: case NPY_CLONGDOUBLE: return 'c';
+        case NPY_STRING: return 'S';
+        case NPY_UNICODE: return 'U';
+        case NPY_VOID: return 'V';
+        default: return '?';
+    }
+}
+
+std::vector<char> cnpy::create_npy_header(const std::vector<size_t>& shape, char type_char, size_t word_size, bool fortran_order) {
+    std::vector<char> dict;
+    dict += "{'descr': '";
+    dict += type_char == 'S' ? '|' : BigEndianTest();
+    dict += type_char;
+    dict += std::to_string(type_char == 'U' ? word_size / 4 : word_size);
+    std::stringstream ss;
+    ss << "', 'fortran_order': ";
+    ss << (fortran_order ? "True": "False");
+    dict += ss.str().c_str();
+    dict += ", 'shape': (";
+    for(size_t i = 0;i < shape.size();i++) {
+        if(i > 0) dict += ", ";
+        dict += std::to_string(shape[i]);
+    }
+    if(shape.size() == 1) dict += ",";
+    dict += "), }";
+    //pad with spaces so that preamble+dict is modulo 16 bytes. preamble is 10 bytes. dict needs to end with \n
+    int remainder = 16 - (10 + dict.size()) % 16;
+    dict.insert(dict.end(),remainder,' ');
+    dict.back() = '\n';
+
+    std::vector<char> header;
+    header += (char) 0x93;
+    header += "NUMPY";
+    header += (char) 0x01; //major version of numpy format
+    header += (char) 0x00; //minor version of numpy format
+    header += (uint16_t) dict.size();
+    header.insert(header.end(),dict.begin(),dict.end());
+
+    return header;
+}
+
+std::vector<char> cnpy::create_npy_header(const NpyArray& array) {
+    return create_npy_header(array.shape, map_npy_type_to_type_char(array.dtype), array.word_size, array.fortran_order);
+}
+
 template<> std::vector<char>& cnpy::operator+=(std::vector<char>& lhs, const std::string rhs) {
     lhs.insert(lhs.end(),rhs.begin(),rhs.end());
     return lhs;
@@ -145,35 +373,34 @@ static NPY_TYPE get_type_from_type_char_and_word_size(char type_char, size_t wor
 }
 } // namespace cnpy
 
-void cnpy::parse_npy_header(unsigned char* buffer, size_t& word_size, std::vector<size_t>& shape, bool& fortran_order, NPY_TYPE& type) {
-    //std::string magic_string(buffer,6);
-    uint8_t major_version = *reinterpret_cast<uint8_t*>(buffer+6);
-    uint8_t minor_version = *reinterpret_cast<uint8_t*>(buffer+7);
-    uint16_t header_len = *reinterpret_cast<uint16_t*>(buffer+8);
-    std::string header(reinterpret_cast<char*>(buffer+9),header_len);
-
+namespace cnpy {
+//fills in the array description from the header dict, e.g. {'descr': '<f8', 'fortran_order': False, 'shape': (3, 4), }
+static void parse_npy_dict(const std::string& header, size_t& word_size, std::vector<size_t>& shape, bool& fortran_order, NPY_TYPE& type) {
     size_t loc1, loc2;
 
     //fortran order
-    loc1 = header.find("fortran_order")+16;
+    loc1 = header.find("fortran_order");
+    if (loc1 == std::string::npos)
+        throw std::runtime_error("parse_npy_header: failed to find header keyword: 'fortran_order'");
+    loc1 += 16;
     fortran_order = (header.substr(loc1,4) == "True" ? true : false);
 
     //shape
     loc1 = header.find("(");
     loc2 = header.find(")");
+    if (loc1 == std::string::npos || loc2 == std::string::npos)
+        throw std::runtime_error("parse_npy_header: failed to find header keyword: '(' or ')'");
 
-    std::regex num_regex("[0-9][0-9]*");
-    std::smatch sm;
     shape.clear();
-
-    std::string str_shape = header.substr(loc1+1,loc2-loc1-1);
-    while(std::regex_search(str_shape, sm, num_regex)) {
-        shape.push_back(std::stoi(sm[0].str()));
-        str_shape = sm.suffix().str();
+    for(size_t i = loc1+1; i < loc2; i++) {
+        if(header[i] < '0' || header[i] > '9') continue;
+        size_t dim = 0;
+        for(; i < loc2 && header[i] >= '0' && header[i] <= '9'; i++) dim = dim*10 + (header[i] - '0');
+        shape.push_back(dim);
     }
 
     //endian, word size, data type
-    //byte order code | stands for not applicable.
+    //byte order code | stands for not applicable. 
     //not sure when this applies except for byte array
     loc1 = header.find("descr");
     if (loc1 == std::string::npos)
@@ -186,6 +413,8 @@ void cnpy::parse_npy_header(unsigned char* buffer, size_t& word_size, std::vecto
     std::string str_ws = header.substr(loc1+2);
     loc2 = str_ws.find("'");
     word_size = atoi(str_ws.substr(0, loc2).c_str());
+    //the size of a unicode dtype is given in characters, each stored as UTF-32
+    if(typechar == 'U') word_size *= 4;
 
     // Optional: check for littleEndian
     bool littleEndian = (byteorder == '<' || byteorder == '|');
@@ -193,83 +422,96 @@ void cnpy::parse_npy_header(unsigned char* buffer, size_t& word_size, std::vecto
 
     type = cnpy::get_type_from_type_char_and_word_size(typechar, word_size);
 }
+} // namespace cnpy
 
-void cnpy::parse_npy_header(FILE* fp, size_t& word_size, std::vector<size_t>& shape, bool& fortran_order, NPY_TYPE& type) {
-    char buffer[256];
-    size_t res = fread(buffer,sizeof(char),11,fp);
-    if(res != 11)
-        throw std::runtime_error("parse_npy_header: failed fread");
-    std::string header = fgets(buffer,256,fp);
-    assert(header[header.size()-1] == '\n');
-
-    size_t loc1, loc2;
-
-    //fortran order
-    loc1 = header.find("fortran_order");
-    if (loc1 == std::string::npos)
-        throw std::runtime_error("parse_npy_header: failed to find header keyword: 'fortran_order'");
-    loc1 += 16;
-    fortran_order = (header.substr(loc1,4) == "True" ? true : false);
+//bounds-checked header parse, untimed so that callers can time it together with reading the header
+static void parse_npy_header_buffer(const unsigned char* buffer, size_t buffer_size, size_t& word_size, std::vector<size_t>& shape, bool& fortran_order, cnpy::NPY_TYPE& type, size_t& header_size) {
+    if(buffer_size < 10 || buffer[0] != 0x93 || memcmp(buffer+1,"NUMPY",5) != 0)
+        throw std::runtime_error("parse_npy_header: missing npy magic string");
+    uint8_t major_version = buffer[6];
+    size_t header_len, dict_offset;
+    if(major_version == 1) {
+        header_len = buffer[8] | (buffer[9] << 8);
+        dict_offset = 10;
+    } else {
+        //versions 2 and 3 use a 4 byte header length
+        if(buffer_size < 12) throw std::runtime_error("parse_npy_header: truncated header");
+        header_len = (size_t)buffer[8] | ((size_t)buffer[9] << 8) | ((size_t)buffer[10] << 16) | ((size_t)buffer[11] << 24);
+        dict_offset = 12;
+    }
+    header_size = dict_offset + header_len;
+    if(header_size > buffer_size) throw std::runtime_error("parse_npy_header: truncated header");
+    cnpy::parse_npy_dict(std::string(reinterpret_cast<const char*>(buffer+dict_offset),header_len), word_size, shape, fortran_order, type);
+}
 
-    //shape
-    loc1 = header.find("(");
-    loc2 = header.find(")");
-    if (loc1 == std::string::npos || loc2 == std::string::npos)
-        throw std::runtime_error("parse_npy_header: failed to find header keyword: '(' or ')'");
+void cnpy::parse_npy_header(const unsigned char* buffer, size_t buffer_size, size_t& word_size, std::vector<size_t>& shape, bool& fortran_order, NPY_TYPE& type, size_t& header_size) {
+    PhaseTimer timer(cnpy::PHASE_HEADER_PARSE);
+    parse_npy_header_buffer(buffer, buffer_size, word_size, shape, fortran_order, type, header_size);
+    timer.add_bytes(header_size);
+}
 
-    std::regex num_regex("[0-9][0-9]*");
-    std::smatch sm;
-    shape.clear();
+void cnpy::parse_npy_header(unsigned char* buffer, size_t& word_size, std::vector<size_t>& shape, bool& fortran_order, NPY_TYPE& type) {
+    size_t header_size;
+    parse_npy_header(buffer, (size_t)-1, word_size, shape, fortran_order, type, header_size);
+}
 
-    std::string str_shape = header.substr(loc1+1,loc2-loc1-1);
-    while(std::regex_search(str_shape, sm, num_regex)) {
-        shape.push_back(std::stoi(sm[0].str()));
-        str_shape = sm.suffix().str();
+void cnpy::parse_npy_header(FILE* fp, size_t& word_size, std::vector<size_t>& shape, bool& fortran_order, NPY_TYPE& type) {
+    //reading the header is timed as part of PHASE_HEADER_PARSE, PHASE_READ is left to the payload
+    PhaseTimer timer(PHASE_HEADER_PARSE);
+    std::vector<unsigned char> buffer(12);
+    size_t res = fread(&buffer[0],sizeof(char),10,fp);
+    if(res != 10)
+        throw std::runtime_error("parse_npy_header: failed fread");
+    if(buffer[0] != 0x93 || memcmp(&buffer[1],"NUMPY",5) != 0)
+        throw std::runtime_error("parse_npy_header: missing npy magic string");
+    size_t header_len = buffer[8] | (buffer[9] << 8);
+    size_t preamble_size = 10;
+    if(buffer[6] != 1) {
+        if(fread(&buffer[10],sizeof(char),2,fp) != 2)
+            throw std::runtime_error("parse_npy_header: failed fread");
+        header_len |= ((size_t)buffer[10] << 16) | ((size_t)buffer[11] << 24);
+        preamble_size = 12;
     }
+    buffer.resize(preamble_size + header_len);
+    if(fread(&buffer[preamble_size],sizeof(char),header_len,fp) != header_len)
+        throw std::runtime_error("parse_npy_header: failed fread");
+    timer.add_bytes(buffer.size());
+    if(buffer.back() != '\n')
+        throw std::runtime_error("parse_npy_header: header does not end in a newline");
 
-    //endian, word size, data type
-    //byte order code | stands for not applicable. 
-    //not sure when this applies except for byte array
-    loc1 = header.find("descr");
-    if (loc1 == std::string::npos)
-        throw std::runtime_error("parse_npy_header: failed to find header keyword: 'descr'");
-
-    loc1 += 9;
-    char byteorder = header[loc1];
-    char typechar = header[loc1+1];
-
-    std::string str_ws = header.substr(loc1+2);
-    loc2 = str_ws.find("'");
-    word_size = atoi(str_ws.substr(0, loc2).c_str());
+    size_t header_size;
+    parse_npy_header_buffer(&buffer[0], buffer.size(), word_size, shape, fortran_order, type, header_size);
+}
 
-    // Optional: check for littleEndian
-    bool littleEndian = (byteorder == '<' || byteorder == '|');
-    assert(littleEndian);  // Keep or remove depending on your target
+static void parse_zip_footer(const char* footer, uint16_t& nrecs, size_t& global_header_size, size_t& global_header_offset)
+{
+    uint16_t disk_no, disk_start, nrecs_on_disk, comment_len;
+    uint32_t size32, offset32;
+    memcpy(&disk_no, &footer[4], 2);
+    memcpy(&disk_start, &footer[6], 2);
+    memcpy(&nrecs_on_disk, &footer[8], 2);
+    memcpy(&nrecs, &footer[10], 2);
+    memcpy(&size32, &footer[12], 4);
+    memcpy(&offset32, &footer[16], 4);
+    memcpy(&comment_len, &footer[20], 2);
+    global_header_size = size32;
+    global_header_offset = offset32;
 
-    type = cnpy::get_type_from_type_char_and_word_size(typechar, word_size);
+    assert(disk_no == 0);
+    assert(disk_start == 0);
+    assert(nrecs_on_disk == nrecs);
+    assert(comment_len == 0);
 }
 
 void cnpy::parse_zip_footer(FILE* fp, uint16_t& nrecs, size_t& global_header_size, size_t& global_header_offset)
 {
     std::vector<char> footer(22);
+    PhaseTimer timer(PHASE_DIRECTORY, 22);
     fseek(fp,-22,SEEK_END);
     size_t res = fread(&footer[0],sizeof(char),22,fp);
     if(res != 22)
         throw std::runtime_error("parse_zip_footer: failed fread");
-
-    uint16_t disk_no, disk_start, nrecs_on_disk, comment_len;
-    disk_no = *(uint16_t*) &footer[4];
-    disk_start = *(uint16_t*) &footer[6];
-    nrecs_on_disk = *(uint16_t*) &footer[8];
-    nrecs = *(uint16_t*) &footer[10];
-    global_header_size = *(uint32_t*) &footer[12];
-    global_header_offset = *(uint32_t*) &footer[16];
-    comment_len = *(uint16_t*) &footer[20];
-
-    assert(disk_no == 0);
-    assert(disk_start == 0);
-    assert(nrecs_on_disk == nrecs);
-    assert(comment_len == 0);
+    ::parse_zip_footer(&footer[0], nrecs, global_header_size, global_header_offset);
 }
 
 cnpy::NpyArray load_the_npy_file(FILE* fp) {
@@ -280,20 +522,37 @@ cnpy::NpyArray load_the_npy_file(FILE* fp) {
     cnpy::parse_npy_header(fp,word_size,shape,fortran_order, type);
 
     cnpy::NpyArray arr(shape, word_size, fortran_order, type);
+    PhaseTimer timer(cnpy::PHASE_READ, arr.num_bytes());
     size_t nread = fread(arr.data<char>(),1,arr.num_bytes(),fp);
     if(nread != arr.num_bytes())
         throw std::runtime_error("load_the_npy_file: failed fread");
     return arr;
 }
 
-cnpy::NpyArray load_the_npz_array(FILE* fp, uint32_t compr_bytes, uint32_t uncompr_bytes) {
+//npy member of a buffer. aliases buffer (sharing ownership with owner) unless copy is set
+static cnpy::NpyArray load_the_npy_buffer(const char* buffer, size_t size, bool copy, const std::shared_ptr<const void>& owner) {
+    std::vector<size_t> shape;
+    size_t word_size, header_size;
+    bool fortran_order;
+    cnpy::NPY_TYPE type;
+    cnpy::parse_npy_header(reinterpret_cast<const unsigned char*>(buffer), size, word_size, shape, fortran_order, type, header_size);
 
-    std::vector<unsigned char> buffer_compr(compr_bytes);
-    std::vector<unsigned char> buffer_uncompr(uncompr_bytes);
-    size_t nread = fread(&buffer_compr[0],1,compr_bytes,fp);
-    if(nread != compr_bytes)
-        throw std::runtime_error("load_the_npy_file: failed fread");
+    size_t num_vals = std::accumulate(shape.begin(), shape.end(), (size_t)1, std::multiplies<size_t>());
+    if(size - header_size < num_vals * word_size)
+        throw std::runtime_error("npy_loads: buffer is smaller than the array it describes");
+
+    if(copy) {
+        cnpy::NpyArray arr(shape, word_size, fortran_order, type);
+        memcpy(arr.data<char>(), buffer + header_size, arr.num_bytes());
+        return arr;
+    }
+    std::shared_ptr<char> data(owner, const_cast<char*>(buffer + header_size));
+    return cnpy::NpyArray(shape, word_size, fortran_order, type, data);
+}
 
+//inflate a raw deflate stream of known uncompressed size
+static void inflate_member(const unsigned char* compr, size_t compr_bytes, unsigned char* uncompr, size_t uncompr_bytes) {
+    PhaseTimer timer(cnpy::PHASE_DECOMPRESS, uncompr_bytes);
     int err;
     z_stream d_stream;
 
@@ -303,20 +562,36 @@ cnpy::NpyArray load_the_npz_array(FILE* fp, uint32_t compr_bytes, uint32_t uncom
     d_stream.avail_in = 0;
     d_stream.next_in = Z_NULL;
     err = inflateInit2(&d_stream, -MAX_WBITS);
+    if(err != Z_OK) throw std::runtime_error("load_the_npz_array: inflateInit2 failed");
+
+    //avail_in/avail_out are 32 bit, feed members over 4 GiB in pieces
+    const size_t max_step = 1u << 30;
+    d_stream.next_in = const_cast<unsigned char*>(compr);
+    d_stream.next_out = uncompr;
+    size_t in_left = compr_bytes, out_left = uncompr_bytes;
+    do {
+        size_t in_step = std::min(in_left, max_step), out_step = std::min(out_left, max_step);
+        d_stream.avail_in = (uInt) in_step;
+        d_stream.avail_out = (uInt) out_step;
+        err = inflate(&d_stream, Z_NO_FLUSH);
+        in_left -= in_step - d_stream.avail_in;
+        out_left -= out_step - d_stream.avail_out;
+    } while(err == Z_OK && out_left > 0);
+    inflateEnd(&d_stream);
+    if(out_left != 0 || (err != Z_OK && err != Z_STREAM_END))
+        throw std::runtime_error("load_the_npz_array: failed to inflate member");
+}
 
-    d_stream.avail_in = compr_bytes;
-    d_stream.next_in = &buffer_compr[0];
-    d_stream.avail_out = uncompr_bytes;
-    d_stream.next_out = &buffer_uncompr[0];
-
-    err = inflate(&d_stream, Z_FINISH);
-    err = inflateEnd(&d_stream);
+//inflate a member, then copy out the array
+static cnpy::NpyArray load_the_deflated_npy(const unsigned char* compr, size_t compr_bytes, size_t uncompr_bytes) {
+    std::vector<unsigned char> buffer_uncompr(uncompr_bytes);
+    inflate_member(compr, compr_bytes, &buffer_uncompr[0], uncompr_bytes);
 
     std::vector<size_t> shape;
-    size_t word_size;
+    size_t word_size, header_size;
     bool fortran_order;
     cnpy::NPY_TYPE type;
-    cnpy::parse_npy_header(&buffer_uncompr[0],word_size,shape,fortran_order, type);
+    cnpy::parse_npy_header(&buffer_uncompr[0],uncompr_bytes,word_size,shape,fortran_order, type, header_size);
 
     cnpy::NpyArray array(shape, word_size, fortran_order, type);
 
@@ -326,93 +601,247 @@ cnpy::NpyArray load_the_npz_array(FILE* fp, uint32_t compr_bytes, uint32_t uncom
     return array;
 }
 
-// --- Helper struct for entry info ---
-struct NpzEntryInfo {
-    std::string array_name;
+cnpy::NpyArray load_the_npz_array(FILE* fp, uint64_t compr_bytes, uint64_t uncompr_bytes) {
+
+    std::vector<unsigned char> buffer_compr(compr_bytes);
+    {
+        PhaseTimer timer(cnpy::PHASE_READ, compr_bytes);
+        size_t nread = fread(&buffer_compr[0],1,compr_bytes,fp);
+        if(nread != compr_bytes)
+            throw std::runtime_error("load_the_npy_file: failed fread");
+    }
+
+    return load_the_deflated_npy(&buffer_compr[0], compr_bytes, uncompr_bytes);
+}
+
+namespace {
+
+uint16_t read_u16(const unsigned char* p) { return p[0] | (p[1] << 8); }
+uint32_t read_u32(const unsigned char* p) { return (uint32_t) read_u16(p) | ((uint32_t) read_u16(p + 2) << 16); }
+uint64_t read_u64(const unsigned char* p) { return (uint64_t) read_u32(p) | ((uint64_t) read_u32(p + 4) << 32); }
+
+bool read_at(FILE* fp, uint64_t offset, void* buffer, size_t byte_count) {
+#ifdef _WIN32
+    if(_fseeki64(fp, offset, SEEK_SET) != 0) return false;
+#else
+    if(fseeko(fp, (off_t) offset, SEEK_SET) != 0) return false;
+#endif
+    return fread(buffer, 1, byte_count, fp) == byte_count;
+}
+
+//one central directory record
+struct ZipDirectoryEntry {
+    std::string name;
+    uint16_t flags;
     uint16_t compression_method;
-    uint32_t compressed_byte_count;
-    uint32_t uncompressed_byte_count;
-    long data_offset; // position in file where data begins
+    uint16_t mod_time;
+    uint16_t mod_date;
+    uint32_t crc;
+    uint64_t compressed_size;
+    uint64_t uncompressed_size;
+    uint64_t local_header_offset;
 };
 
-// --- Helper: parse next entry header and fill info ---
-static bool parse_npz_entry(FILE* fp, NpzEntryInfo& info) {
-    std::vector<char> local_header(30);
-    size_t header_read_byte_count = fread(&local_header[0], sizeof(char), 30, fp);
-    if(header_read_byte_count != 30) return false;
-    if(local_header[2] != 0x03 || local_header[3] != 0x04) return false;
-
-    uint16_t name_byte_count;
-    memcpy(&name_byte_count, &local_header[26], sizeof(uint16_t));
-    uint16_t extra_field_byte_count;
-    memcpy(&extra_field_byte_count, &local_header[28], sizeof(uint16_t));
-    uint16_t compression_method;
-    memcpy(&compression_method, &local_header[8], sizeof(uint16_t));
-    uint32_t compressed_byte_count;
-    memcpy(&compressed_byte_count, &local_header[18], sizeof(uint32_t));
-    uint32_t uncompressed_byte_count;
-    memcpy(&uncompressed_byte_count, &local_header[22], sizeof(uint32_t));
-    // Read file name
-    std::string array_name(name_byte_count, ' ');
-    size_t array_name_read_byte_count = fread(&array_name[0], sizeof(char), name_byte_count, fp);
-    if(array_name_read_byte_count != name_byte_count) return false;
-    array_name.erase(array_name.end() - 4, array_name.end());
-    // Read extra field
-    std::vector<char> extra_field(extra_field_byte_count);
-    if(extra_field_byte_count > 0) {
-        size_t read = fread(&extra_field[0], sizeof(char), extra_field_byte_count, fp);
-        if(read != extra_field_byte_count) return false;
-    }
-    // ZIP64 fix
-    if(compressed_byte_count == 0xFFFFFFFF || uncompressed_byte_count == 0xFFFFFFFF) {
-        size_t idx = 0;
-        while(idx + 4 <= extra_field.size()) {
-            uint16_t header_id, data_size;
-            memcpy(&header_id, &extra_field[idx], 2);
-            memcpy(&data_size, &extra_field[idx+2], 2);
-            if(header_id == 0x0001) {
-                size_t zip64_idx = idx + 4;
-                uint64_t zip64_size = 0;
-                if(uncompressed_byte_count == 0xFFFFFFFF && zip64_idx + 8 <= extra_field.size()) {
-                    memcpy(&zip64_size, &extra_field[zip64_idx], 8);
-                    uncompressed_byte_count = static_cast<uint32_t>(zip64_size);
-                    zip64_idx += 8;
-                }
-                if(compressed_byte_count == 0xFFFFFFFF && zip64_idx + 8 <= extra_field.size()) {
-                    memcpy(&zip64_size, &extra_field[zip64_idx], 8);
-                    compressed_byte_count = static_cast<uint32_t>(zip64_size);
-                    zip64_idx += 8;
-                }
+//central directory of an archive of file_size bytes, following zip64 end records and skipping an archive comment.
+//bytes are fetched with read_bytes(offset, buffer, byte_count), which returns false past the end
+template<typename Reader>
+std::vector<ZipDirectoryEntry> parse_zip_directory(Reader read_bytes, uint64_t file_size, uint64_t& directory_offset, uint64_t& directory_size) {
+    PhaseTimer timer(cnpy::PHASE_DIRECTORY);
+    size_t tail_size = (size_t) std::min<uint64_t>(file_size, 22 + 65535);
+    std::vector<unsigned char> tail(tail_size);
+    if(!read_bytes(file_size - tail_size, &tail[0], tail_size)) throw std::runtime_error("zip directory: failed fread");
+
+    size_t eocd = tail_size;
+    for(size_t i = tail_size >= 22 ? tail_size - 22 + 1 : 0; i-- > 0;) {
+        if(tail[i] == 'P' && tail[i+1] == 'K' && tail[i+2] == 5 && tail[i+3] == 6) { eocd = i; break; }
+    }
+    if(eocd == tail_size) throw std::runtime_error("zip directory: no zip end of central directory record");
+
+    uint64_t record_count = read_u16(&tail[eocd + 10]);
+    directory_size = read_u32(&tail[eocd + 12]);
+    directory_offset = read_u32(&tail[eocd + 16]);
+    if(record_count == 0xFFFF || directory_size == 0xFFFFFFFF || directory_offset == 0xFFFFFFFF) {
+        //zip64: the locator sits right before the end record and points at the zip64 end record
+        unsigned char locator[20], record[56];
+        uint64_t eocd_offset = file_size - tail_size + eocd;
+        if(eocd_offset < 20 || !read_bytes(eocd_offset - 20, locator, 20) || read_u32(locator) != 0x07064b50)
+            throw std::runtime_error("zip directory: missing zip64 end of central directory locator");
+        if(!read_bytes(read_u64(locator + 8), record, 56) || read_u32(record) != 0x06064b50)
+            throw std::runtime_error("zip directory: missing zip64 end of central directory record");
+        record_count = read_u64(record + 32);
+        directory_size = read_u64(record + 40);
+        directory_offset = read_u64(record + 48);
+    }
+
+    std::vector<unsigned char> directory((size_t) directory_size);
+    if(directory_size > 0 && !read_bytes(directory_offset, &directory[0], directory.size()))
+        throw std::runtime_error("zip directory: failed to read the central directory");
+    timer.add_bytes(directory_size);
+
+    std::vector<ZipDirectoryEntry> entries;
+    size_t pos = 0;
+    for(uint64_t i = 0; i < record_count; i++) {
+        if(pos + 46 > directory.size() || read_u32(&directory[pos]) != 0x02014b50)
+            throw std::runtime_error("zip directory: corrupt central directory");
+        const unsigned char* record = &directory[pos];
+        uint16_t name_size = read_u16(record + 28), extra_size = read_u16(record + 30), comment_size = read_u16(record + 32);
+        if(pos + 46 + name_size + extra_size + comment_size > directory.size())
+            throw std::runtime_error("zip directory: corrupt central directory");
+        ZipDirectoryEntry entry;
+        entry.flags = read_u16(record + 8);
+        entry.compression_method = read_u16(record + 10);
+        entry.mod_time = read_u16(record + 12);
+        entry.mod_date = read_u16(record + 14);
+        entry.crc = read_u32(record + 16);
+        entry.compressed_size = read_u32(record + 20);
+        entry.uncompressed_size = read_u32(record + 24);
+        entry.local_header_offset = read_u32(record + 42);
+        entry.name.assign(reinterpret_cast<const char*>(record + 46), name_size);
+        //zip64 extra field holds the 64 bit values of the fields that are saturated, in this order
+        const unsigned char* extra = record + 46 + name_size;
+        for(size_t e = 0; e + 4 <= extra_size;) {
+            uint16_t id = read_u16(extra + e), size = read_u16(extra + e + 2);
+            if(id == 0x0001) {
+                size_t f = e + 4;
+                if(entry.uncompressed_size == 0xFFFFFFFF && f + 8 <= e + 4 + size) { entry.uncompressed_size = read_u64(extra + f); f += 8; }
+                if(entry.compressed_size == 0xFFFFFFFF && f + 8 <= e + 4 + size) { entry.compressed_size = read_u64(extra + f); f += 8; }
+                if(entry.local_header_offset == 0xFFFFFFFF && f + 8 <= e + 4 + size) { entry.local_header_offset = read_u64(extra + f); f += 8; }
                 break;
             }
-            idx += 4 + data_size;
+            e += 4 + size;
         }
+        entries.push_back(entry);
+        pos += 46 + name_size + extra_size + comment_size;
     }
-    info.array_name = array_name;
-    info.compression_method = compression_method;
-    info.compressed_byte_count = compressed_byte_count;
-    info.uncompressed_byte_count = uncompressed_byte_count;
-    info.data_offset = ftell(fp);
-    return true;
+    return entries;
+}
+
+std::vector<ZipDirectoryEntry> read_zip_directory(FILE* fp, uint64_t& directory_offset, uint64_t& directory_size) {
+    fseek(fp, 0, SEEK_END);
+    uint64_t file_size = (uint64_t) ftello(fp);
+    return parse_zip_directory([fp](uint64_t offset, void* buffer, size_t byte_count) {
+        return read_at(fp, offset, buffer, byte_count);
+    }, file_size, directory_offset, directory_size);
+}
+
+std::vector<ZipDirectoryEntry> read_zip_directory(const char* data, size_t size, uint64_t& directory_offset, uint64_t& directory_size) {
+    return parse_zip_directory([data, size](uint64_t offset, void* buffer, size_t byte_count) {
+        if(offset > size || byte_count > size - offset) return false;
+        memcpy(buffer, data + offset, byte_count);
+        return true;
+    }, size, directory_offset, directory_size);
+}
+
+std::vector<ZipDirectoryEntry> read_zip_directory(const cnpy::ScatterBuffer& archive, uint64_t& directory_offset, uint64_t& directory_size) {
+    const std::vector<std::pair<const char*, size_t>>& segments = archive.segments;
+    return parse_zip_directory([&segments](uint64_t offset, void* buffer, size_t byte_count) {
+        char* out = static_cast<char*>(buffer);
+        for(size_t i = 0; i < segments.size() && byte_count > 0; i++) {
+            if(offset >= segments[i].second) {
+                offset -= segments[i].second;
+                continue;
+            }
+            size_t chunk = std::min<size_t>(byte_count, segments[i].second - (size_t) offset);
+            memcpy(out, segments[i].first + offset, chunk);
+            out += chunk;
+            byte_count -= chunk;
+            offset = 0;
+        }
+        return byte_count == 0;
+    }, archive.num_bytes(), directory_offset, directory_size);
+}
+
+//offset of the member data behind its local header
+uint64_t zip_member_data_offset(FILE* fp, const ZipDirectoryEntry& entry) {
+    unsigned char local_header[30];
+    if(!read_at(fp, entry.local_header_offset, local_header, 30) || read_u32(local_header) != 0x04034b50)
+        throw std::runtime_error("zip directory: corrupt local header for "+entry.name);
+    return entry.local_header_offset + 30 + read_u16(local_header + 26) + read_u16(local_header + 28);
+}
+
+//an archive member as listed by the central directory. the directory, not a walk over the local headers, is what
+//counts: npz_replace and npz_remove leave the bytes of dropped members in place and only rewrite the directory
+struct NpzEntryInfo {
+    std::string array_name;
+    uint16_t compression_method;
+    uint64_t compressed_byte_count;
+    uint64_t uncompressed_byte_count;
+    uint64_t data_offset; // position in the archive where the member data begins
+};
+
+NpzEntryInfo npz_entry_info(const ZipDirectoryEntry& entry, uint64_t data_offset) {
+    NpzEntryInfo info;
+    // File name, without the .npy suffix
+    info.array_name = entry.name;
+    if(info.array_name.size() >= 4) info.array_name.erase(info.array_name.end() - 4, info.array_name.end());
+    info.compression_method = entry.compression_method;
+    info.compressed_byte_count = entry.compressed_size;
+    info.uncompressed_byte_count = entry.uncompressed_size;
+    info.data_offset = data_offset;
+    return info;
 }
 
+std::vector<NpzEntryInfo> npz_entries(FILE* fp) {
+    uint64_t directory_offset, directory_size;
+    std::vector<ZipDirectoryEntry> directory = read_zip_directory(fp, directory_offset, directory_size);
+    std::vector<NpzEntryInfo> entries;
+    for(size_t i = 0; i < directory.size(); i++)
+        entries.push_back(npz_entry_info(directory[i], zip_member_data_offset(fp, directory[i])));
+    return entries;
+}
+
+std::vector<NpzEntryInfo> npz_entries(const char* buffer, size_t size) {
+    uint64_t directory_offset, directory_size;
+    std::vector<ZipDirectoryEntry> directory = read_zip_directory(buffer, size, directory_offset, directory_size);
+    std::vector<NpzEntryInfo> entries;
+    for(size_t i = 0; i < directory.size(); i++) {
+        const unsigned char* local_header = reinterpret_cast<const unsigned char*>(buffer) + directory[i].local_header_offset;
+        if(directory[i].local_header_offset > size || size - directory[i].local_header_offset < 30 || read_u32(local_header) != 0x04034b50)
+            throw std::runtime_error("npz_loads: corrupt local header for "+directory[i].name);
+        uint64_t data_offset = directory[i].local_header_offset + 30 + read_u16(local_header + 26) + read_u16(local_header + 28);
+        if(data_offset > size || directory[i].compressed_size > size - data_offset)
+            throw std::runtime_error("npz_loads: member "+directory[i].name+" extends past the end of the buffer");
+        entries.push_back(npz_entry_info(directory[i], data_offset));
+    }
+    return entries;
+}
+
+void seek_to(FILE* fp, uint64_t offset) {
+#ifdef _WIN32
+    _fseeki64(fp, offset, SEEK_SET);
+#else
+    fseeko(fp, (off_t) offset, SEEK_SET);
+#endif
+}
+
+} // namespace
+
 // --- Refactored npz_load (single file, all arrays) ---
 cnpy::npz_t cnpy::npz_load(std::string fname) {
-    FILE* fp = fopen(fname.c_str(),"rb");
+    MetricsPathScope path_scope(fname);
+    FILE* fp;
+    {
+        PhaseTimer timer(PHASE_OPEN);
+        fp = fopen(fname.c_str(),"rb");
+    }
     if(!fp) throw std::runtime_error("npz_load: Error! Unable to open file "+fname+"!");
     cnpy::npz_t arrays;
-    while(1) {
-        NpzEntryInfo info;
-        long entry_start = ftell(fp);
-        if(!parse_npz_entry(fp, info)) break;
-        fseek(fp, info.data_offset, SEEK_SET);
-        if(info.compression_method == 0) {
-            arrays[info.array_name] = load_the_npy_file(fp);
-        } else {
-            arrays[info.array_name] = load_the_npz_array(fp, info.compressed_byte_count, info.uncompressed_byte_count);
+    std::vector<NpzEntryInfo> entries;
+    try {
+        entries = npz_entries(fp);
+        //a name listed twice (appended again with npz_save) loads the later copy, as numpy does
+        for(size_t i = 0; i < entries.size(); i++) {
+            const NpzEntryInfo& info = entries[i];
+            seek_to(fp, info.data_offset);
+            if(info.compression_method == 0) {
+                arrays[info.array_name] = load_the_npy_file(fp);
+            } else {
+                arrays[info.array_name] = load_the_npz_array(fp, info.compressed_byte_count, info.uncompressed_byte_count);
+            }
         }
-        fseek(fp, entry_start + 30 + info.array_name.size() + 4 + info.compressed_byte_count + info.uncompressed_byte_count, SEEK_SET); // skip to next entry
-        // Actually, after reading, fp is at end of data, so just continue
+    } catch(...) {
+        fclose(fp);
+        throw;
     }
     fclose(fp);
     return arrays;
@@ -424,20 +853,21 @@ cnpy::NpyArray cnpy::npz_load(std::string fname, std::string varname) {
         FILE * fp;
         ~AutoCloser() { fclose(fp); }
     } closer{};
-    closer.fp = fopen(fname.c_str(), "rb");
+    MetricsPathScope path_scope(fname);
+    {
+        PhaseTimer timer(PHASE_OPEN);
+        closer.fp = fopen(fname.c_str(), "rb");
+    }
     if(!closer.fp) throw std::runtime_error("npz_load: Unable to open file "+fname);
-    while(1) {
-        NpzEntryInfo info;
-        if(!parse_npz_entry(closer.fp, info)) break;
-        if(info.array_name == varname) {
-            fseek(closer.fp, info.data_offset, SEEK_SET);
-            if(info.compression_method == 0) {
-                return load_the_npy_file(closer.fp);
-            } else {
-                return load_the_npz_array(closer.fp, info.compressed_byte_count, info.uncompressed_byte_count);
-            }
+    std::vector<NpzEntryInfo> entries = npz_entries(closer.fp);
+    for(size_t i = entries.size(); i-- > 0;) {
+        const NpzEntryInfo& info = entries[i];
+        if(info.array_name != varname) continue;
+        seek_to(closer.fp, info.data_offset);
+        if(info.compression_method == 0) {
+            return load_the_npy_file(closer.fp);
         } else {
-            fseek(closer.fp, info.data_offset + info.compressed_byte_count, SEEK_SET);
+            return load_the_npz_array(closer.fp, info.compressed_byte_count, info.uncompressed_byte_count);
         }
     }
     throw std::runtime_error("npz_load: variable not found: " + varname);
@@ -453,7 +883,11 @@ cnpy::NpyArray cnpy::npy_load(std::string fname) {
             fclose(fp);
         }
     } closer;
-    closer.fp = fopen(fname.c_str(), "rb");
+    MetricsPathScope path_scope(fname);
+    {
+        PhaseTimer timer(PHASE_OPEN);
+        closer.fp = fopen(fname.c_str(), "rb");
+    }
 
     if(!closer.fp) throw std::runtime_error("npy_load: Unable to open file "+fname);
 
@@ -461,3 +895,1910 @@ cnpy::NpyArray cnpy::npy_load(std::string fname) {
 
     return arr;
 }
+
+cnpy::NpyArray cnpy::npy_loads(const char* buffer, size_t size, bool copy) {
+    return load_the_npy_buffer(buffer, size, copy, std::shared_ptr<const void>());
+}
+
+cnpy::NpyArray cnpy::npy_loads(const char* buffer, size_t size, std::shared_ptr<const void> owner) {
+    return load_the_npy_buffer(buffer, size, false, owner);
+}
+
+static cnpy::NpyArray load_the_npz_member(const char* buffer, const NpzEntryInfo& info, bool copy, const std::shared_ptr<const void>& owner) {
+    const char* member = buffer + info.data_offset;
+    if(info.compression_method == 0)
+        return load_the_npy_buffer(member, info.compressed_byte_count, copy, owner);
+    return load_the_deflated_npy(reinterpret_cast<const unsigned char*>(member), info.compressed_byte_count, info.uncompressed_byte_count);
+}
+
+static cnpy::npz_t load_the_npz_buffer(const char* buffer, size_t size, bool copy, const std::shared_ptr<const void>& owner) {
+    cnpy::npz_t arrays;
+    std::vector<NpzEntryInfo> entries = npz_entries(buffer, size);
+    for(size_t i = 0; i < entries.size(); i++)
+        arrays[entries[i].array_name] = load_the_npz_member(buffer, entries[i], copy, owner);
+    return arrays;
+}
+
+static cnpy::NpyArray load_the_npz_buffer(const char* buffer, size_t size, const std::string& varname, bool copy, const std::shared_ptr<const void>& owner) {
+    std::vector<NpzEntryInfo> entries = npz_entries(buffer, size);
+    for(size_t i = entries.size(); i-- > 0;)
+        if(entries[i].array_name == varname) return load_the_npz_member(buffer, entries[i], copy, owner);
+    throw std::runtime_error("npz_loads: variable not found: " + varname);
+}
+
+cnpy::npz_t cnpy::npz_loads(const char* buffer, size_t size, bool copy) {
+    return load_the_npz_buffer(buffer, size, copy, std::shared_ptr<const void>());
+}
+
+cnpy::NpyArray cnpy::npz_loads(const char* buffer, size_t size, const std::string& varname, bool copy) {
+    return load_the_npz_buffer(buffer, size, varname, copy, std::shared_ptr<const void>());
+}
+
+cnpy::NpyArray cnpy::npz_loads(const char* buffer, size_t size, const char* varname, bool copy) {
+    return load_the_npz_buffer(buffer, size, std::string(varname), copy, std::shared_ptr<const void>());
+}
+
+cnpy::npz_t cnpy::npz_loads(const char* buffer, size_t size, std::shared_ptr<const void> owner) {
+    return load_the_npz_buffer(buffer, size, false, owner);
+}
+
+cnpy::NpyArray cnpy::npz_loads(const char* buffer, size_t size, const std::string& varname, std::shared_ptr<const void> owner) {
+    return load_the_npz_buffer(buffer, size, varname, false, owner);
+}
+
+namespace {
+
+//byte length of the npy preamble + header dict of the file at the current position of fp
+size_t read_npy_header_length(FILE* fp) {
+    unsigned char preamble[12];
+    if(fread(preamble,1,10,fp) != 10 || preamble[0] != 0x93 || memcmp(preamble+1,"NUMPY",5) != 0)
+        throw std::runtime_error("read_npy_header_length: not an npy file");
+    if(preamble[6] == 1) return 10 + (preamble[8] | (preamble[9] << 8));
+    if(fread(preamble+10,1,2,fp) != 2) throw std::runtime_error("read_npy_header_length: failed fread");
+    return 12 + ((size_t)preamble[8] | ((size_t)preamble[9] << 8) | ((size_t)preamble[10] << 16) | ((size_t)preamble[11] << 24));
+}
+
+//destination of every save. writes are checked and throw on failure.
+//in atomic mode the data goes to a temporary file beside the target that only replaces it in commit(),
+//after being flushed to stable storage. an uncommitted sink removes its temporary file.
+class FileSink {
+public:
+    FileSink(const std::string& target, bool atomic, bool update_in_place = false) :
+        fp(NULL), target(target), atomic(atomic), committed(false)
+    {
+        PhaseTimer timer(cnpy::PHASE_OPEN);
+        if(!atomic) {
+            fp = fopen(target.c_str(), update_in_place ? "r+b" : "wb");
+            if(!fp) throw std::runtime_error("Unable to open file "+target+": "+strerror(errno));
+            return;
+        }
+#ifdef _WIN32
+        throw std::runtime_error("atomic writes are not supported on this platform");
+#else
+        static std::atomic<unsigned> counter(0);
+        for(int attempt = 0; attempt < 100 && !fp; attempt++) {
+            temp_path = target + ".tmp." + std::to_string(getpid()) + "." + std::to_string(counter++);
+            int fd = open(temp_path.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0666);
+            if(fd < 0) {
+                if(errno == EEXIST) continue;
+                throw std::runtime_error("Unable to create temporary file "+temp_path+": "+strerror(errno));
+            }
+            fp = fdopen(fd, "wb");
+            if(!fp) {
+                close(fd);
+                unlink(temp_path.c_str());
+                throw std::runtime_error("Unable to open temporary file "+temp_path);
+            }
+        }
+        if(!fp) throw std::runtime_error("Unable to create a temporary file for "+target);
+#endif
+    }
+
+    ~FileSink() {
+        if(committed) return;
+        if(fp) fclose(fp);
+#ifndef _WIN32
+        if(atomic) unlink(temp_path.c_str());
+#endif
+    }
+
+    FILE* file() { return fp; }
+
+    void write(const void* data, size_t byte_count) {
+        PhaseTimer timer(cnpy::PHASE_WRITE, byte_count);
+        if(byte_count > 0 && fwrite(data, 1, byte_count, fp) != byte_count)
+            throw std::runtime_error("failed fwrite to "+target+": "+strerror(errno));
+    }
+
+    void seek(int64_t offset, int whence) {
+#ifdef _WIN32
+        int res = _fseeki64(fp, offset, whence);
+#else
+        int res = fseeko(fp, (off_t) offset, whence);
+#endif
+        if(res != 0) throw std::runtime_error("failed fseek in "+target);
+    }
+
+    //drop everything behind the current position, for edits that shrink the file
+    void truncate() {
+        if(fflush(fp) != 0) throw std::runtime_error("failed fflush of "+target);
+#ifdef _WIN32
+        int res = _chsize_s(_fileno(fp), _ftelli64(fp));
+#else
+        int res = ftruncate(fileno(fp), ftello(fp));
+#endif
+        if(res != 0) throw std::runtime_error("failed to truncate "+target+": "+strerror(errno));
+    }
+
+    //append byte_count bytes of src starting at offset
+    void copy_from(FILE* src, uint64_t offset, uint64_t byte_count) {
+#ifdef __linux__
+        //let the kernel copy (or reflink) the range without bouncing it through user space
+        if(fflush(fp) != 0) throw std::runtime_error("failed fflush of "+target);
+        off_t in_offset = (off_t) offset;
+        off_t out_offset = ftello(fp);
+        uint64_t remaining = byte_count;
+        {
+            PhaseTimer timer(cnpy::PHASE_WRITE);
+            while(remaining > 0) {
+                ssize_t copied = copy_file_range(fileno(src), &in_offset, fileno(fp), &out_offset, remaining, 0);
+                if(copied <= 0) break;
+                remaining -= copied;
+                timer.add_bytes(copied);
+            }
+        }
+        seek(out_offset, SEEK_SET);
+        offset = (uint64_t) in_offset;
+        byte_count = remaining;
+#endif
+        if(byte_count == 0) return;
+#ifdef _WIN32
+        _fseeki64(src, offset, SEEK_SET);
+#else
+        fseeko(src, (off_t) offset, SEEK_SET);
+#endif
+        //fallback: the reads are timed here, write() times itself
+        std::vector<char> buffer((size_t) std::min<uint64_t>(byte_count, 1 << 20));
+        while(byte_count > 0) {
+            size_t chunk = (size_t) std::min<uint64_t>(byte_count, buffer.size());
+            {
+                PhaseTimer timer(cnpy::PHASE_READ, chunk);
+                if(fread(&buffer[0], 1, chunk, src) != chunk)
+                    throw std::runtime_error("failed fread while copying into "+target);
+            }
+            write(&buffer[0], chunk);
+            byte_count -= chunk;
+        }
+    }
+
+    void commit() {
+        PhaseTimer timer(cnpy::PHASE_FSYNC);
+        if(fflush(fp) != 0) throw std::runtime_error("failed fflush of "+target+": "+strerror(errno));
+#ifndef _WIN32
+        if(atomic) {
+            int fd = fileno(fp);
+#ifdef __linux__
+            if(fdatasync(fd) != 0) throw std::runtime_error("failed fdatasync of "+temp_path+": "+strerror(errno));
+#else
+            if(fsync(fd) != 0) throw std::runtime_error("failed fsync of "+temp_path+": "+strerror(errno));
+#endif
+            //keep the permissions of the file being replaced
+            struct stat target_stat;
+            if(stat(target.c_str(), &target_stat) == 0) fchmod(fd, target_stat.st_mode & 07777);
+        }
+#endif
+        int res = fclose(fp);
+        fp = NULL;
+        if(res != 0) throw std::runtime_error("failed fclose of "+target+": "+strerror(errno));
+#ifndef _WIN32
+        if(atomic) {
+            if(rename(temp_path.c_str(), target.c_str()) != 0)
+                throw std::runtime_error("failed to rename "+temp_path+" to "+target+": "+strerror(errno));
+            //make the rename itself durable
+            size_t slash = target.find_last_of('/');
+            std::string dir = slash == std::string::npos ? "." : (slash == 0 ? "/" : target.substr(0, slash));
+            int dir_fd = open(dir.c_str(), O_RDONLY);
+            if(dir_fd >= 0) {
+                fsync(dir_fd);
+                close(dir_fd);
+            }
+        }
+#endif
+        committed = true;
+    }
+
+private:
+    FILE* fp;
+    std::string target;
+    std::string temp_path;
+    bool atomic;
+    bool committed;
+};
+
+struct FileCloser {
+    FILE* fp;
+    ~FileCloser() { if(fp) fclose(fp); }
+};
+
+uint32_t crc_update(uint32_t crc, const char* data, size_t byte_count) {
+    PhaseTimer timer(cnpy::PHASE_CRC, byte_count);
+    //crc32 takes a 32 bit length
+    for(size_t offset = 0; offset < byte_count; offset += 1u << 30) {
+        size_t chunk = std::min<size_t>(byte_count - offset, 1u << 30);
+        crc = crc32(crc,(uint8_t*)data + offset,(uInt) chunk);
+    }
+    return crc;
+}
+
+uint32_t member_crc(const std::vector<char>& npy_header, const char* payload, size_t payload_bytes) {
+    return crc_update(crc_update(0L, &npy_header[0], npy_header.size()), payload, payload_bytes);
+}
+
+//hands the elements of source to emit(pointer, byte_count) in output order.
+//axes that are contiguous in memory are merged into runs; runs are copied into a staging buffer
+//so that emit sees few large pieces. a fully contiguous source is emitted in place.
+template<typename Emit> void gather_payload(const cnpy::StridedSource& source, Emit emit) {
+    const size_t staging_size = 4 << 20;
+    if(source.shape.size() != source.byte_strides.size())
+        throw std::runtime_error("strided save: need one stride per axis");
+
+    //axes from fastest to slowest varying in the output, dropping the trivial ones
+    std::vector<size_t> extents;
+    std::vector<ptrdiff_t> strides;
+    for(size_t i = 0; i < source.shape.size(); i++) {
+        size_t axis = source.fortran_order ? i : source.shape.size() - 1 - i;
+        if(source.shape[axis] == 0) return;
+        if(source.shape[axis] == 1) continue;
+        extents.push_back(source.shape[axis]);
+        strides.push_back(source.byte_strides[axis]);
+    }
+
+    size_t run_bytes = source.word_size;
+    size_t first_outer = 0;
+    while(first_outer < extents.size() && strides[first_outer] == (ptrdiff_t) run_bytes)
+        run_bytes *= extents[first_outer++];
+
+    //merge outer axes that step over each other exactly, fewer odometer digits
+    std::vector<size_t> outer_extents;
+    std::vector<ptrdiff_t> outer_strides;
+    for(size_t i = first_outer; i < extents.size(); i++) {
+        if(!outer_extents.empty() && strides[i] == outer_strides.back() * (ptrdiff_t) outer_extents.back()) {
+            outer_extents.back() *= extents[i];
+            continue;
+        }
+        outer_extents.push_back(extents[i]);
+        outer_strides.push_back(strides[i]);
+    }
+
+    if(outer_extents.empty()) {
+        emit(source.base, run_bytes);
+        return;
+    }
+
+    std::vector<char> staging;
+    if(run_bytes < staging_size) staging.resize(staging_size - staging_size % run_bytes);
+    size_t staged = 0;
+    std::vector<size_t> index(outer_extents.size(), 0);
+    const char* run = source.base;
+    while(true) {
+        if(staging.empty()) {
+            emit(run, run_bytes);
+        } else {
+            memcpy(&staging[staged], run, run_bytes);
+            staged += run_bytes;
+            if(staged == staging.size()) {
+                emit(&staging[0], staged);
+                staged = 0;
+            }
+        }
+
+        //advance the odometer
+        size_t digit = 0;
+        for(; digit < index.size(); digit++) {
+            run += outer_strides[digit];
+            if(++index[digit] < outer_extents[digit]) break;
+            run -= outer_strides[digit] * (ptrdiff_t) outer_extents[digit];
+            index[digit] = 0;
+        }
+        if(digit == index.size()) break;
+    }
+    if(staged > 0) emit(&staging[0], staged);
+}
+
+//zip records written when an archive is edited. sizes and offsets that do not fit 32 bits go to zip64 extra fields
+void put_local_header(std::vector<char>& out, const ZipDirectoryEntry& entry) {
+    using cnpy::operator+=;
+    bool zip64 = entry.compressed_size >= 0xFFFFFFFF || entry.uncompressed_size >= 0xFFFFFFFF;
+    out += (uint32_t) 0x04034b50;
+    out += (uint16_t) (zip64 ? 45 : 20); //min version to extract
+    out += (uint16_t) (entry.flags & ~8); //sizes are known up front, no data descriptor
+    out += entry.compression_method;
+    out += entry.mod_time;
+    out += entry.mod_date;
+    out += entry.crc;
+    out += (uint32_t) (zip64 ? 0xFFFFFFFF : entry.compressed_size);
+    out += (uint32_t) (zip64 ? 0xFFFFFFFF : entry.uncompressed_size);
+    out += (uint16_t) entry.name.size();
+    out += (uint16_t) (zip64 ? 20 : 0);
+    out += entry.name;
+    if(zip64) {
+        out += (uint16_t) 0x0001;
+        out += (uint16_t) 16;
+        out += entry.uncompressed_size;
+        out += entry.compressed_size;
+    }
+}
+
+void put_central_record(std::vector<char>& out, const ZipDirectoryEntry& entry) {
+    using cnpy::operator+=;
+    std::vector<char> extra;
+    if(entry.uncompressed_size >= 0xFFFFFFFF) extra += entry.uncompressed_size;
+    if(entry.compressed_size >= 0xFFFFFFFF) extra += entry.compressed_size;
+    if(entry.local_header_offset >= 0xFFFFFFFF) extra += entry.local_header_offset;
+    out += (uint32_t) 0x02014b50;
+    out += (uint16_t) 45; //version made by
+    out += (uint16_t) (extra.empty() ? 20 : 45); //min version to extract
+    out += (uint16_t) (entry.flags & ~8);
+    out += entry.compression_method;
+    out += entry.mod_time;
+    out += entry.mod_date;
+    out += entry.crc;
+    out += (uint32_t) std::min<uint64_t>(entry.compressed_size, 0xFFFFFFFF);
+    out += (uint32_t) std::min<uint64_t>(entry.uncompressed_size, 0xFFFFFFFF);
+    out += (uint16_t) entry.name.size();
+    out += (uint16_t) (extra.empty() ? 0 : 4 + extra.size());
+    out += (uint16_t) 0; //file comment length
+    out += (uint16_t) 0; //disk number where file starts
+    out += (uint16_t) 0; //internal file attributes
+    out += (uint32_t) 0; //external file attributes
+    out += (uint32_t) std::min<uint64_t>(entry.local_header_offset, 0xFFFFFFFF);
+    out += entry.name;
+    if(!extra.empty()) {
+        out += (uint16_t) 0x0001;
+        out += (uint16_t) extra.size();
+        out.insert(out.end(), extra.begin(), extra.end());
+    }
+}
+
+//central directory for entries, starting at directory_offset, followed by the end records
+void put_zip_directory(std::vector<char>& directory, const std::vector<ZipDirectoryEntry>& entries, uint64_t directory_offset) {
+    using cnpy::operator+=;
+    PhaseTimer timer(cnpy::PHASE_DIRECTORY);
+    size_t first = directory.size();
+    for(size_t i = 0; i < entries.size(); i++) put_central_record(directory, entries[i]);
+    uint64_t directory_size = directory.size() - first;
+    timer.add_bytes(directory_size);
+
+    bool zip64 = entries.size() >= 0xFFFF || directory_size >= 0xFFFFFFFF || directory_offset >= 0xFFFFFFFF;
+    if(zip64) {
+        uint64_t record_offset = directory_offset + directory_size;
+        directory += (uint32_t) 0x06064b50;
+        directory += (uint64_t) 44; //size of the rest of the record
+        directory += (uint16_t) 45; //version made by
+        directory += (uint16_t) 45; //min version to extract
+        directory += (uint32_t) 0; //number of this disk
+        directory += (uint32_t) 0; //disk where the directory starts
+        directory += (uint64_t) entries.size();
+        directory += (uint64_t) entries.size();
+        directory += directory_size;
+        directory += directory_offset;
+        //locator
+        directory += (uint32_t) 0x07064b50;
+        directory += (uint32_t) 0; //disk with the zip64 end record
+        directory += record_offset;
+        directory += (uint32_t) 1; //total number of disks
+    }
+    directory += (uint32_t) 0x06054b50;
+    directory += (uint16_t) 0; //number of this disk
+    directory += (uint16_t) 0; //disk where footer starts
+    directory += (uint16_t) std::min<size_t>(entries.size(), 0xFFFF);
+    directory += (uint16_t) std::min<size_t>(entries.size(), 0xFFFF);
+    directory += (uint32_t) std::min<uint64_t>(directory_size, 0xFFFFFFFF);
+    directory += (uint32_t) std::min<uint64_t>(directory_offset, 0xFFFFFFFF);
+    directory += (uint16_t) 0; //zip file comment length
+}
+
+void write_zip_directory(FileSink& sink, const std::vector<ZipDirectoryEntry>& entries, uint64_t directory_offset) {
+    std::vector<char> directory;
+    put_zip_directory(directory, entries, directory_offset);
+    sink.write(&directory[0], directory.size());
+}
+
+//writes the stored member at entry.local_header_offset, filling in its CRC; leaves the sink behind the member
+void write_stored_member(FileSink& sink, ZipDirectoryEntry& entry, const std::vector<char>& npy_header, const cnpy::StridedSource& payload) {
+    std::vector<char> local_header;
+    put_local_header(local_header, entry);
+    sink.seek(entry.local_header_offset, SEEK_SET);
+    sink.write(&local_header[0], local_header.size());
+    sink.write(&npy_header[0], npy_header.size());
+    uint32_t crc = crc_update(0L, &npy_header[0], npy_header.size());
+    gather_payload(payload, [&](const char* data, size_t byte_count) {
+        crc = crc_update(crc, data, byte_count);
+        sink.write(data, byte_count);
+    });
+    entry.crc = crc;
+    local_header.clear();
+    put_local_header(local_header, entry);
+    sink.seek(entry.local_header_offset, SEEK_SET);
+    sink.write(&local_header[0], local_header.size());
+    sink.seek(entry.local_header_offset + local_header.size() + entry.compressed_size, SEEK_SET);
+}
+
+//sink positioned at the start of the central directory. in place for a plain edit; for an atomic one,
+//a new file holding the members in front of the directory
+std::unique_ptr<FileSink> open_for_edit(const std::string& zipname, FileCloser& existing, uint64_t directory_offset, bool atomic) {
+    std::unique_ptr<FileSink> sink;
+    if(!atomic) {
+        fclose(existing.fp);
+        existing.fp = NULL;
+        sink.reset(new FileSink(zipname, false, true));
+        sink->seek(directory_offset, SEEK_SET);
+    } else {
+        sink.reset(new FileSink(zipname, true));
+        sink->copy_from(existing.fp, 0, directory_offset);
+    }
+    return sink;
+}
+
+} // namespace
+
+void cnpy::npy_write(const std::string& fname, const std::vector<char>& header, const char* payload, size_t payload_bytes, bool append, bool atomic) {
+    npy_write(fname, header, StridedSource::contiguous(payload, payload_bytes), append, atomic);
+}
+
+void cnpy::npy_write(const std::string& fname, const std::vector<char>& header, const StridedSource& payload, bool append, bool atomic) {
+    MetricsPathScope path_scope(fname);
+    if(!append) {
+        FileSink sink(fname, atomic);
+        sink.write(&header[0], header.size());
+        gather_payload(payload, [&](const char* data, size_t byte_count) { sink.write(data, byte_count); });
+        sink.commit();
+        return;
+    }
+
+    FileCloser existing{fopen(fname.c_str(), "rb")};
+    if(!existing.fp) throw std::runtime_error("npy_save: Unable to open file "+fname);
+    size_t old_header_size = read_npy_header_length(existing.fp);
+
+    if(!atomic && old_header_size == header.size()) {
+        //same header length, patch the header and append the payload in place
+        fclose(existing.fp);
+        existing.fp = NULL;
+        FileSink sink(fname, false, true);
+        sink.write(&header[0], header.size());
+        sink.seek(0, SEEK_END);
+        gather_payload(payload, [&](const char* data, size_t byte_count) { sink.write(data, byte_count); });
+        sink.commit();
+        return;
+    }
+
+    //rewrite the file: new header, old payload, new payload. the old payload is read back from the file
+    //being replaced, so this always goes through a temporary file, whatever atomic says
+    if(fseek(existing.fp, 0, SEEK_END) != 0) throw std::runtime_error("npy_save: failed fseek in "+fname);
+    uint64_t old_size = (uint64_t) ftello(existing.fp);
+    FileSink sink(fname, true);
+    sink.write(&header[0], header.size());
+    sink.copy_from(existing.fp, old_header_size, old_size - old_header_size);
+    gather_payload(payload, [&](const char* data, size_t byte_count) { sink.write(data, byte_count); });
+    sink.commit();
+}
+
+void cnpy::npz_add_member(const std::string& zipname, std::string member_name, const std::vector<char>& npy_header, const char* payload, size_t payload_bytes, bool append, bool atomic) {
+    npz_add_member(zipname, member_name, npy_header, StridedSource::contiguous(payload, payload_bytes), append, atomic);
+}
+
+void cnpy::npz_add_member(const std::string& zipname, std::string member_name, const std::vector<char>& npy_header, const StridedSource& payload, bool append, bool atomic) {
+    MetricsPathScope path_scope(zipname);
+    ZipDirectoryEntry member = ZipDirectoryEntry();
+    member.name = member_name + ".npy";
+    member.compressed_size = member.uncompressed_size = npy_header.size() + payload.num_bytes();
+
+    //the new member is written where the central directory used to start, followed by the directory with one more record
+    std::vector<ZipDirectoryEntry> entries;
+    uint64_t directory_offset = 0;
+    FileCloser existing{append ? fopen(zipname.c_str(), "rb") : NULL};
+    std::unique_ptr<FileSink> sink;
+    if(existing.fp) {
+        uint64_t directory_size;
+        entries = read_zip_directory(existing.fp, directory_offset, directory_size);
+        sink = open_for_edit(zipname, existing, directory_offset, atomic);
+    } else {
+        sink.reset(new FileSink(zipname, atomic));
+    }
+
+    member.local_header_offset = directory_offset;
+    write_stored_member(*sink, member, npy_header, payload);
+    entries.push_back(member);
+    std::vector<char> local_header;
+    put_local_header(local_header, member);
+    write_zip_directory(*sink, entries, member.local_header_offset + local_header.size() + member.compressed_size);
+    //the old end records may have been longer (zip64, archive comment)
+    sink->truncate();
+    sink->commit();
+}
+
+void cnpy::npz_add_member(std::vector<char>& buffer, std::string member_name, const std::vector<char>& npy_header, const char* payload, size_t payload_bytes, bool append) {
+    ZipDirectoryEntry member = ZipDirectoryEntry();
+    member.name = member_name + ".npy";
+    member.compressed_size = member.uncompressed_size = npy_header.size() + payload_bytes;
+    member.crc = member_crc(npy_header, payload, payload_bytes);
+
+    std::vector<ZipDirectoryEntry> entries;
+    uint64_t directory_offset = 0;
+    if(append) {
+        uint64_t directory_size;
+        entries = read_zip_directory(buffer.data(), buffer.size(), directory_offset, directory_size);
+    }
+    member.local_header_offset = directory_offset;
+    entries.push_back(member);
+
+    //the new member goes where the central directory used to start
+    buffer.resize(directory_offset);
+    put_local_header(buffer, member);
+    buffer.insert(buffer.end(), npy_header.begin(), npy_header.end());
+    buffer.insert(buffer.end(), payload, payload + payload_bytes);
+    put_zip_directory(buffer, entries, buffer.size());
+}
+
+void cnpy::npz_add_member(ScatterBuffer& archive, std::string member_name, const std::vector<char>& npy_header, const char* payload, size_t payload_bytes, bool append) {
+    ZipDirectoryEntry member = ZipDirectoryEntry();
+    member.name = member_name + ".npy";
+    member.compressed_size = member.uncompressed_size = npy_header.size() + payload_bytes;
+    member.crc = member_crc(npy_header, payload, payload_bytes);
+
+    std::vector<ZipDirectoryEntry> entries;
+    uint64_t directory_offset = 0;
+    if(append) {
+        uint64_t directory_size;
+        entries = read_zip_directory(archive, directory_offset, directory_size);
+        //drop the segments holding the old directory, cutting the one it starts in
+        uint64_t kept = 0;
+        size_t count = 0;
+        while(count < archive.segments.size() && kept + archive.segments[count].second <= directory_offset)
+            kept += archive.segments[count++].second;
+        if(kept < directory_offset) archive.segments[count++].second = (size_t) (directory_offset - kept);
+        if(count < archive.segments.size() && !archive.storage.empty() && archive.segments.back().first == archive.storage.back().data())
+            archive.storage.pop_back();
+        archive.segments.resize(count);
+    } else {
+        archive.segments.clear();
+        archive.storage.clear();
+    }
+    member.local_header_offset = directory_offset;
+    entries.push_back(member);
+
+    std::vector<char> headers;
+    put_local_header(headers, member);
+    headers.insert(headers.end(), npy_header.begin(), npy_header.end());
+    std::vector<char> directory;
+    put_zip_directory(directory, entries, directory_offset + headers.size() + payload_bytes);
+    archive.append_copy(std::move(headers));
+    archive.append_reference(payload, payload_bytes);
+    archive.append_copy(std::move(directory));
+}
+
+namespace {
+
+void append_utf8(uint32_t code_point, std::string& out) {
+    if(code_point > 0x10FFFF || (code_point >= 0xD800 && code_point <= 0xDFFF)) code_point = 0xFFFD;
+    if(code_point < 0x80) {
+        out += (char) code_point;
+    } else if(code_point < 0x800) {
+        out += (char) (0xC0 | (code_point >> 6));
+        out += (char) (0x80 | (code_point & 0x3F));
+    } else if(code_point < 0x10000) {
+        out += (char) (0xE0 | (code_point >> 12));
+        out += (char) (0x80 | ((code_point >> 6) & 0x3F));
+        out += (char) (0x80 | (code_point & 0x3F));
+    } else {
+        out += (char) (0xF0 | (code_point >> 18));
+        out += (char) (0x80 | ((code_point >> 12) & 0x3F));
+        out += (char) (0x80 | ((code_point >> 6) & 0x3F));
+        out += (char) (0x80 | (code_point & 0x3F));
+    }
+}
+
+//one element of a 'U' array (little endian UTF-32, NUL padded) as UTF-8
+void utf32_to_utf8(const char* element, size_t count, std::string& out) {
+    uint32_t last = 0;
+    while(count > 0 && (memcpy(&last, element + 4 * (count - 1), 4), last == 0)) count--;
+    out.clear();
+    out.reserve(count);
+    size_t i = 0;
+    while(i < count) {
+        //labels are mostly ascii: test eight code points at once and narrow them together.
+        //fixed trip counts, so the compiler turns both loops into vector instructions
+        if(i + 8 <= count) {
+            uint32_t block[8];
+            memcpy(block, element + 4 * i, sizeof(block));
+            uint32_t combined = 0;
+            for(int k = 0; k < 8; k++) combined |= block[k];
+            if(combined < 0x80) {
+                char ascii[8];
+                for(int k = 0; k < 8; k++) ascii[k] = (char) block[k];
+                out.append(ascii, 8);
+                i += 8;
+                continue;
+            }
+        }
+        uint32_t code_point;
+        memcpy(&code_point, element + 4 * i, 4);
+        append_utf8(code_point, out);
+        i++;
+    }
+}
+
+//decodes the UTF-8 sequence at p, advancing it. malformed input yields U+FFFD
+uint32_t next_code_point(const unsigned char*& p, const unsigned char* end) {
+    unsigned char lead = *p++;
+    if(lead < 0x80) return lead;
+    size_t extra = lead >= 0xF0 ? 3 : lead >= 0xE0 ? 2 : lead >= 0xC0 ? 1 : 0;
+    if(extra == 0 || lead > 0xF4) return 0xFFFD;
+    uint32_t code_point = lead & (0x3F >> extra);
+    for(size_t k = 0; k < extra; k++) {
+        if(p == end || (*p & 0xC0) != 0x80) return 0xFFFD;
+        code_point = (code_point << 6) | (*p++ & 0x3F);
+    }
+    return code_point;
+}
+
+size_t count_code_points(const std::string& s) {
+    const unsigned char* p = (const unsigned char*) s.data();
+    const unsigned char* end = p + s.size();
+    size_t count = 0;
+    for(; p != end; count++) next_code_point(p, end);
+    return count;
+}
+
+//NUL padded fixed width elements for an 'S' or 'U' array. width is in characters, 0 picks the longest string
+std::vector<char> pack_strings(const std::vector<std::string>& strings, cnpy::NPY_TYPE dtype, size_t& width) {
+    bool unicode = dtype == cnpy::NPY_UNICODE;
+    if(!unicode && dtype != cnpy::NPY_STRING) throw std::runtime_error("string arrays must be NPY_STRING or NPY_UNICODE");
+    size_t longest = 0;
+    for(size_t i = 0; i < strings.size(); i++)
+        longest = std::max(longest, unicode ? count_code_points(strings[i]) : strings[i].size());
+    if(width == 0) width = std::max<size_t>(longest, 1); //numpy has no zero width strings
+    if(longest > width) throw std::runtime_error("string of "+std::to_string(longest)+" characters does not fit width "+std::to_string(width));
+
+    size_t word_size = unicode ? 4 * width : width;
+    std::vector<char> payload(strings.size() * word_size, 0);
+    for(size_t i = 0; i < strings.size(); i++) {
+        char* element = &payload[i * word_size];
+        if(!unicode) {
+            memcpy(element, strings[i].data(), strings[i].size());
+            continue;
+        }
+        const unsigned char* p = (const unsigned char*) strings[i].data();
+        const unsigned char* end = p + strings[i].size();
+        for(char* out = element; p != end; out += 4) {
+            uint32_t code_point = next_code_point(p, end);
+            memcpy(out, &code_point, 4);
+        }
+    }
+    return payload;
+}
+
+} // namespace
+
+std::string cnpy::NpyArray::string_at(size_t i) const {
+    if(dtype == NPY_UNICODE) {
+        std::string result;
+        utf32_to_utf8(data<char>() + i * word_size, word_size / 4, result);
+        return result;
+    }
+    if(dtype != NPY_STRING) throw std::runtime_error("string_at: array does not hold strings");
+    size_t length;
+    const char* p = string_data(i, length);
+    return std::string(p, length);
+}
+
+std::vector<std::string> cnpy::NpyArray::as_strings() const {
+    if(dtype != NPY_STRING && dtype != NPY_UNICODE) throw std::runtime_error("as_strings: array does not hold strings");
+    std::vector<std::string> strings(num_vals);
+    for(size_t i = 0; i < num_vals; i++) {
+        if(dtype == NPY_UNICODE) {
+            utf32_to_utf8(data<char>() + i * word_size, word_size / 4, strings[i]);
+        } else {
+            size_t length;
+            const char* p = string_data(i, length);
+            strings[i].assign(p, length);
+        }
+    }
+    return strings;
+}
+
+void cnpy::npy_save_strings(const std::string& fname, const std::vector<std::string>& strings, NPY_TYPE dtype, const std::string& mode, bool atomic) {
+    size_t width = 0;
+    size_t total = strings.size();
+    FILE* fp = mode == "a" ? fopen(fname.c_str(), "rb") : NULL;
+    if(fp) {
+        //appended strings take the width of the existing array
+        size_t word_size;
+        std::vector<size_t> shape;
+        bool fortran_order;
+        NPY_TYPE type;
+        try {
+            parse_npy_header(fp, word_size, shape, fortran_order, type);
+        } catch(...) {
+            fclose(fp);
+            throw;
+        }
+        fclose(fp);
+        if(type != dtype || shape.size() != 1)
+            throw std::runtime_error("npy_save_strings: "+fname+" does not hold a 1-d array of the same string type");
+        width = dtype == NPY_UNICODE ? word_size / 4 : word_size;
+        total += shape[0];
+    }
+
+    std::vector<char> payload = pack_strings(strings, dtype, width);
+    std::vector<size_t> shape(1, total);
+    std::vector<char> header = create_npy_header(shape, dtype == NPY_UNICODE ? 'U' : 'S', dtype == NPY_UNICODE ? 4 * width : width, false);
+    npy_write(fname, header, payload.data(), payload.size(), fp != NULL, atomic);
+}
+
+void cnpy::npz_save_strings(const std::string& zipname, const std::string& fname, const std::vector<std::string>& strings, NPY_TYPE dtype, const std::string& mode, bool atomic) {
+    size_t width = 0;
+    std::vector<char> payload = pack_strings(strings, dtype, width);
+    std::vector<size_t> shape(1, strings.size());
+    std::vector<char> header = create_npy_header(shape, dtype == NPY_UNICODE ? 'U' : 'S', dtype == NPY_UNICODE ? 4 * width : width, false);
+    npz_add_member(zipname, fname, header, payload.data(), payload.size(), mode == "a", atomic);
+}
+
+#ifndef _WIN32
+static void pwrite_all(int fd, const char* buffer, size_t byte_count, off_t offset) {
+    PhaseTimer timer(cnpy::PHASE_WRITE, byte_count);
+    while(byte_count > 0) {
+        ssize_t written = pwrite(fd, buffer, byte_count, offset);
+        if(written < 0) {
+            if(errno == EINTR) continue;
+            throw std::runtime_error(std::string("pwrite failed: ") + strerror(errno));
+        }
+        buffer += written;
+        byte_count -= written;
+        offset += written;
+    }
+}
+#endif
+
+void cnpy::npy_write_parallel(const std::string& fname, const std::vector<char>& header, const char* payload, size_t payload_bytes, const ParallelWriteOptions& options) {
+    typedef std::chrono::steady_clock clock;
+    clock::time_point start = clock::now();
+    MetricsPathScope path_scope(fname);
+    size_t total_bytes = header.size() + payload_bytes;
+#ifdef _WIN32
+    //no pwrite here, fall back to one sequential writer
+    FILE* fp = fopen(fname.c_str(),"wb");
+    if(!fp) throw std::runtime_error("npy_save_parallel: Unable to open file "+fname);
+    bool ok = fwrite(&header[0],sizeof(char),header.size(),fp) == header.size();
+    ok = ok && fwrite(payload,sizeof(char),payload_bytes,fp) == payload_bytes;
+    ok = (fclose(fp) == 0) && ok;
+    if(!ok) throw std::runtime_error("npy_save_parallel: failed writing "+fname);
+    if(options.progress)
+        options.progress(total_bytes, total_bytes, std::chrono::duration<double>(clock::now() - start).count());
+#else
+    int fd;
+    {
+        PhaseTimer timer(PHASE_OPEN);
+        fd = open(fname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    }
+    if(fd < 0) throw std::runtime_error("npy_save_parallel: Unable to open file "+fname+": "+strerror(errno));
+
+    //reserve the blocks up front so the writers never extend the file concurrently
+    int err = 0;
+#ifdef __linux__
+    if(fallocate(fd, 0, 0, (off_t) total_bytes) != 0 && errno != EOPNOTSUPP && errno != ENOSYS) err = errno;
+#endif
+    if(err == 0 && ftruncate(fd, (off_t) total_bytes) != 0) err = errno;
+    if(err != 0) {
+        close(fd);
+        throw std::runtime_error("npy_save_parallel: failed to preallocate "+fname+": "+strerror(err));
+    }
+
+    const size_t alignment = 4096;
+    size_t chunk_size = std::max(options.chunk_size, alignment);
+    chunk_size = (chunk_size + alignment - 1) / alignment * alignment;
+
+    //chunk k covers file offsets [k*chunk_size, (k+1)*chunk_size), clipped to the payload
+    size_t first_chunk = header.size() / chunk_size;
+    size_t end_chunk = (total_bytes + chunk_size - 1) / chunk_size;
+
+    size_t num_threads = options.num_threads;
+    if(num_threads == 0) num_threads = std::max(1u, std::thread::hardware_concurrency());
+    num_threads = std::min(num_threads, std::max<size_t>(end_chunk - first_chunk, 1));
+
+    std::atomic<size_t> next_chunk(first_chunk);
+    std::atomic<bool> failed(false);
+    std::mutex progress_mutex;
+    size_t bytes_done = 0;
+    std::string error_message;
+
+    auto report = [&](size_t byte_count) {
+        std::lock_guard<std::mutex> lock(progress_mutex);
+        bytes_done += byte_count;
+        if(options.progress)
+            options.progress(bytes_done, total_bytes, std::chrono::duration<double>(clock::now() - start).count());
+    };
+
+    auto worker = [&]() {
+        MetricsPathScope worker_path_scope(fname);
+        try {
+            for(size_t chunk = next_chunk++; chunk < end_chunk && !failed; chunk = next_chunk++) {
+                size_t begin = std::max(chunk * chunk_size, header.size());
+                size_t end = std::min((chunk + 1) * chunk_size, total_bytes);
+                pwrite_all(fd, payload + (begin - header.size()), end - begin, (off_t) begin);
+                report(end - begin);
+            }
+        } catch(const std::exception& e) {
+            std::lock_guard<std::mutex> lock(progress_mutex);
+            if(!failed.exchange(true)) error_message = e.what();
+        }
+    };
+
+    try {
+        pwrite_all(fd, &header[0], header.size(), 0);
+        report(header.size());
+    } catch(const std::exception& e) {
+        failed = true;
+        error_message = e.what();
+    }
+
+    if(!failed) {
+        std::vector<std::thread> threads;
+        try {
+            for(size_t i = 1; i < num_threads; i++) threads.push_back(std::thread(worker));
+        } catch(...) {
+            //could not start a thread: stop the ones running, they must be joined before they go out of scope
+            failed = true;
+            for(size_t i = 0; i < threads.size(); i++) threads[i].join();
+            close(fd);
+            throw;
+        }
+        worker();
+        for(size_t i = 0; i < threads.size(); i++) threads[i].join();
+    }
+
+    if(close(fd) != 0 && !failed) {
+        failed = true;
+        error_message = std::string("close failed: ") + strerror(errno);
+    }
+    if(failed) throw std::runtime_error("npy_save_parallel: "+fname+": "+error_message);
+#endif
+}
+
+#ifndef _WIN32
+namespace {
+
+//segment layout: ShmIndexHeader, member_count ShmIndexEntry records, names, then 64 byte aligned npy members
+const char shm_magic[8] = {'C','N','P','Y','S','H','M','1'};
+
+struct ShmIndexHeader {
+    char magic[8];      //written last, a segment without it is still being published
+    uint64_t total_size;
+    uint64_t member_count;
+};
+
+struct ShmIndexEntry {
+    uint64_t name_offset;
+    uint64_t name_size;
+    uint64_t npy_offset;
+    uint64_t npy_size;
+};
+
+struct ShmMapping {
+    void* address;
+    size_t size;
+    ~ShmMapping() { munmap(address, size); }
+};
+
+std::string shm_segment_name(const std::string& name) {
+    return name.empty() || name[0] != '/' ? "/" + name : name;
+}
+
+size_t align_up(size_t value, size_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+} // namespace
+
+void cnpy::shm_publish(const std::string& name, const npz_t& arrays) {
+    std::string segment = shm_segment_name(name);
+
+    //lay out the segment before creating it
+    std::vector<ShmIndexEntry> entries;
+    std::vector<std::vector<char>> headers;
+    size_t offset = sizeof(ShmIndexHeader) + arrays.size() * sizeof(ShmIndexEntry);
+    for(npz_t::const_iterator it = arrays.begin(); it != arrays.end(); ++it) {
+        ShmIndexEntry entry;
+        entry.name_offset = offset;
+        entry.name_size = it->first.size();
+        offset += it->first.size();
+        entries.push_back(entry);
+    }
+    size_t i = 0;
+    for(npz_t::const_iterator it = arrays.begin(); it != arrays.end(); ++it, ++i) {
+        headers.push_back(create_npy_header(it->second));
+        offset = align_up(offset, 64);
+        entries[i].npy_offset = offset;
+        entries[i].npy_size = headers[i].size() + it->second.num_bytes();
+        offset += entries[i].npy_size;
+    }
+    size_t total_size = std::max(offset, sizeof(ShmIndexHeader));
+
+    ::shm_unlink(segment.c_str());
+    int fd = shm_open(segment.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+    if(fd < 0) throw std::runtime_error("shm_publish: unable to create "+segment+": "+strerror(errno));
+    if(ftruncate(fd, (off_t) total_size) != 0) {
+        int err = errno;
+        close(fd);
+        ::shm_unlink(segment.c_str());
+        throw std::runtime_error("shm_publish: unable to size "+segment+": "+strerror(err));
+    }
+#ifdef __linux__
+    //ftruncate leaves the segment sparse; reserve the pages now so a full /dev/shm fails here and not as a SIGBUS in memcpy
+    int err;
+    while((err = posix_fallocate(fd, 0, (off_t) total_size)) == EINTR) { }
+    if(err != 0) {
+        close(fd);
+        ::shm_unlink(segment.c_str());
+        throw std::runtime_error("shm_publish: unable to allocate "+std::to_string(total_size)+" bytes for "+segment+": "+strerror(err));
+    }
+#endif
+    void* address = mmap(NULL, total_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(address == MAP_FAILED) {
+        ::shm_unlink(segment.c_str());
+        throw std::runtime_error("shm_publish: unable to map "+segment+": "+strerror(errno));
+    }
+
+    char* base = static_cast<char*>(address);
+    ShmIndexHeader index;
+    memset(index.magic, 0, sizeof(index.magic));
+    index.total_size = total_size;
+    index.member_count = arrays.size();
+    memcpy(base, &index, sizeof(index));
+    memcpy(base + sizeof(index), entries.data(), entries.size() * sizeof(ShmIndexEntry));
+    i = 0;
+    for(npz_t::const_iterator it = arrays.begin(); it != arrays.end(); ++it, ++i) {
+        memcpy(base + entries[i].name_offset, it->first.data(), it->first.size());
+        memcpy(base + entries[i].npy_offset, headers[i].data(), headers[i].size());
+        if(it->second.num_bytes() > 0)
+            memcpy(base + entries[i].npy_offset + headers[i].size(), it->second.data<char>(), it->second.num_bytes());
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(base, shm_magic, sizeof(shm_magic));
+    munmap(address, total_size);
+}
+
+void cnpy::shm_publish(const std::string& name, const NpyArray& array, const std::string& varname) {
+    npz_t arrays;
+    arrays[varname] = array;
+    shm_publish(name, arrays);
+}
+
+cnpy::npz_t cnpy::shm_attach(const std::string& name) {
+    std::string segment = shm_segment_name(name);
+    int fd = shm_open(segment.c_str(), O_RDONLY, 0);
+    if(fd < 0) throw std::runtime_error("shm_attach: unable to open "+segment+": "+strerror(errno));
+    struct stat segment_stat;
+    if(fstat(fd, &segment_stat) != 0 || (size_t) segment_stat.st_size < sizeof(ShmIndexHeader)) {
+        close(fd);
+        throw std::runtime_error("shm_attach: "+segment+" is not a published segment");
+    }
+    size_t size = segment_stat.st_size;
+    void* address = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(address == MAP_FAILED) throw std::runtime_error("shm_attach: unable to map "+segment+": "+strerror(errno));
+    std::shared_ptr<ShmMapping> mapping(new ShmMapping{address, size});
+
+    const char* base = static_cast<const char*>(address);
+    ShmIndexHeader index;
+    memcpy(&index, base, sizeof(index));
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if(memcmp(index.magic, shm_magic, sizeof(shm_magic)) != 0 || index.total_size > size
+        || index.member_count > (size - sizeof(index)) / sizeof(ShmIndexEntry))
+        throw std::runtime_error("shm_attach: "+segment+" is not a published segment");
+
+    npz_t arrays;
+    for(uint64_t i = 0; i < index.member_count; i++) {
+        ShmIndexEntry entry;
+        memcpy(&entry, base + sizeof(index) + i * sizeof(entry), sizeof(entry));
+        if(entry.name_offset + entry.name_size > size || entry.npy_offset + entry.npy_size > size)
+            throw std::runtime_error("shm_attach: corrupt index in "+segment);
+        std::string varname(base + entry.name_offset, entry.name_size);
+        arrays[varname] = npy_loads(base + entry.npy_offset, entry.npy_size, std::shared_ptr<const void>(mapping));
+    }
+    return arrays;
+}
+
+cnpy::NpyArray cnpy::shm_attach(const std::string& name, const std::string& varname) {
+    npz_t arrays = shm_attach(name);
+    npz_t::iterator it = arrays.find(varname);
+    if(it == arrays.end()) throw std::runtime_error("shm_attach: variable not found: "+varname);
+    return it->second;
+}
+
+void cnpy::shm_remove(const std::string& name) {
+    std::string segment = shm_segment_name(name);
+    if(::shm_unlink(segment.c_str()) != 0 && errno != ENOENT)
+        throw std::runtime_error("shm_remove: unable to remove "+segment+": "+strerror(errno));
+}
+#else
+void cnpy::shm_publish(const std::string&, const npz_t&) {
+    throw std::runtime_error("shm_publish: POSIX shared memory is not available on this platform");
+}
+
+void cnpy::shm_publish(const std::string&, const NpyArray&, const std::string&) {
+    throw std::runtime_error("shm_publish: POSIX shared memory is not available on this platform");
+}
+
+cnpy::npz_t cnpy::shm_attach(const std::string&) {
+    throw std::runtime_error("shm_attach: POSIX shared memory is not available on this platform");
+}
+
+cnpy::NpyArray cnpy::shm_attach(const std::string&, const std::string&) {
+    throw std::runtime_error("shm_attach: POSIX shared memory is not available on this platform");
+}
+
+void cnpy::shm_remove(const std::string&) {
+    throw std::runtime_error("shm_remove: POSIX shared memory is not available on this platform");
+}
+#endif
+
+namespace {
+
+//what a cached entry was loaded from. a path whose identity changed is reloaded
+struct FileIdentity {
+    uint64_t device;
+    uint64_t inode;
+    uint64_t size;
+    int64_t mtime_ns;
+
+    bool operator==(const FileIdentity& other) const {
+        return device == other.device && inode == other.inode && size == other.size && mtime_ns == other.mtime_ns;
+    }
+};
+
+bool stat_identity(const std::string& fname, FileIdentity& identity) {
+    struct stat file_stat;
+    if(stat(fname.c_str(), &file_stat) != 0) return false;
+    identity.device = file_stat.st_dev;
+    identity.inode = file_stat.st_ino;
+    identity.size = file_stat.st_size;
+#if defined(__APPLE__)
+    identity.mtime_ns = (int64_t) file_stat.st_mtimespec.tv_sec * 1000000000 + file_stat.st_mtimespec.tv_nsec;
+#elif defined(_WIN32)
+    identity.mtime_ns = (int64_t) file_stat.st_mtime * 1000000000;
+#else
+    identity.mtime_ns = (int64_t) file_stat.st_mtim.tv_sec * 1000000000 + file_stat.st_mtim.tv_nsec;
+#endif
+    return true;
+}
+
+//the cache is split into shards by key, each with its own LRU list, so lookups and inserts lock one shard.
+//the byte bound is on the whole cache: while it is exceeded, the least recently used entry of each shard is
+//dropped in turn, one shard locked at a time, so evicting an entry is O(1). an entry larger than the whole
+//capacity is not cached.
+class ArrayCache {
+public:
+    static const size_t shard_count = 16;
+
+    ArrayCache() : capacity(0), total_bytes(0), hits(0), misses(0), evictions(0), evict_cursor(0) { }
+
+    bool enabled() const { return capacity.load(std::memory_order_relaxed) > 0; }
+
+    bool find(const std::string& key, const FileIdentity& identity, cnpy::npz_t& value) {
+        Shard& shard = shard_for(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        std::unordered_map<std::string, Entry>::iterator it = shard.entries.find(key);
+        if(it == shard.entries.end() || !(it->second.identity == identity)) {
+            misses++;
+            return false;
+        }
+        shard.lru.splice(shard.lru.begin(), shard.lru, it->second.lru_position);
+        value = it->second.value;
+        hits++;
+        return true;
+    }
+
+    void insert(const std::string& key, const FileIdentity& identity, const cnpy::npz_t& value) {
+        size_t bytes = 0;
+        for(cnpy::npz_t::const_iterator it = value.begin(); it != value.end(); ++it) bytes += it->second.num_bytes();
+        if(bytes > capacity.load()) return;
+        {
+            Shard& shard = shard_for(key);
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            std::unordered_map<std::string, Entry>::iterator it = shard.entries.find(key);
+            if(it == shard.entries.end()) {
+                it = shard.entries.insert(std::make_pair(key, Entry())).first;
+                shard.lru.push_front(key);
+                it->second.lru_position = shard.lru.begin();
+            } else {
+                shard.lru.splice(shard.lru.begin(), shard.lru, it->second.lru_position);
+                shard.bytes -= it->second.bytes;
+                total_bytes -= it->second.bytes;
+            }
+            it->second.identity = identity;
+            it->second.value = value;
+            it->second.bytes = bytes;
+            shard.bytes += bytes;
+            total_bytes += bytes;
+        }
+        evict(&key);
+    }
+
+    void set_capacity(size_t max_bytes) {
+        capacity = max_bytes;
+        evict(NULL);
+    }
+
+    void clear() {
+        for(size_t i = 0; i < shard_count; i++) {
+            std::lock_guard<std::mutex> lock(shards[i].mutex);
+            total_bytes -= shards[i].bytes;
+            shards[i].bytes = 0;
+            shards[i].entries.clear();
+            shards[i].lru.clear();
+        }
+    }
+
+    cnpy::ArrayCacheStats stats() {
+        cnpy::ArrayCacheStats result;
+        for(size_t i = 0; i < shard_count; i++) {
+            std::lock_guard<std::mutex> lock(shards[i].mutex);
+            result.entries += shards[i].entries.size();
+        }
+        result.hits = hits;
+        result.misses = misses;
+        result.evictions = evictions;
+        result.bytes = total_bytes;
+        result.capacity = capacity;
+        return result;
+    }
+
+private:
+    struct Entry {
+        Entry() : bytes(0) { }
+        FileIdentity identity;
+        cnpy::npz_t value;
+        size_t bytes;
+        std::list<std::string>::iterator lru_position;
+    };
+
+    struct Shard {
+        Shard() : bytes(0) { }
+        std::mutex mutex;
+        std::unordered_map<std::string, Entry> entries;
+        std::list<std::string> lru; //most recently used first
+        size_t bytes;
+    };
+
+    Shard& shard_for(const std::string& key) {
+        return shards[std::hash<std::string>()(key) % shard_count];
+    }
+
+    //drop the least recently used entry of one shard after another until the cache fits its capacity.
+    //keep, the entry just inserted, is passed over so it is not pushed out by older entries
+    void evict(const std::string* keep) {
+        size_t idle = 0;
+        while(total_bytes.load() > capacity.load() && idle < shard_count) {
+            Shard& shard = shards[evict_cursor++ % shard_count];
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            if(shard.lru.empty() || (keep && shard.lru.back() == *keep)) {
+                idle++;
+                continue;
+            }
+            idle = 0;
+            std::unordered_map<std::string, Entry>::iterator it = shard.entries.find(shard.lru.back());
+            shard.bytes -= it->second.bytes;
+            total_bytes -= it->second.bytes;
+            shard.entries.erase(it);
+            shard.lru.pop_back();
+            evictions++;
+        }
+    }
+
+    Shard shards[shard_count];
+    std::atomic<size_t> capacity;
+    std::atomic<size_t> total_bytes;
+    std::atomic<size_t> hits;
+    std::atomic<size_t> misses;
+    std::atomic<size_t> evictions;
+    std::atomic<size_t> evict_cursor;
+};
+
+ArrayCache& array_cache() {
+    static ArrayCache cache;
+    return cache;
+}
+
+//look key up, loading (and caching) it when missing or stale
+template<typename Loader>
+cnpy::npz_t load_cached(const std::string& fname, const std::string& key, Loader load) {
+    ArrayCache& cache = array_cache();
+    FileIdentity identity;
+    if(!cache.enabled() || !stat_identity(fname, identity)) return load();
+
+    cnpy::npz_t value;
+    if(cache.find(key, identity, value)) return value;
+
+    value = load();
+    //only keep it if the file did not change while it was being read
+    FileIdentity identity_after;
+    if(stat_identity(fname, identity_after) && identity_after == identity) cache.insert(key, identity, value);
+    return value;
+}
+
+} // namespace
+
+void cnpy::cache_set_capacity(size_t max_bytes) {
+    array_cache().set_capacity(max_bytes);
+}
+
+void cnpy::cache_clear() {
+    array_cache().clear();
+}
+
+cnpy::ArrayCacheStats cnpy::cache_stats() {
+    return array_cache().stats();
+}
+
+cnpy::NpyArray cnpy::npy_load_cached(const std::string& fname) {
+    npz_t value = load_cached(fname, "npy\n" + fname, [&]() {
+        npz_t arrays;
+        arrays[""] = npy_load(fname);
+        return arrays;
+    });
+    return value.begin()->second;
+}
+
+cnpy::npz_t cnpy::npz_load_cached(const std::string& fname) {
+    return load_cached(fname, "npz\n" + fname, [&]() { return npz_load(fname); });
+}
+
+cnpy::NpyArray cnpy::npz_load_cached(const std::string& fname, const std::string& varname) {
+    npz_t value = load_cached(fname, "npz\n" + fname + "\n" + varname, [&]() {
+        npz_t arrays;
+        arrays[varname] = npz_load(fname, varname);
+        return arrays;
+    });
+    return value.begin()->second;
+}
+
+namespace {
+
+//bytes needed for the complete npy header given its first 12 bytes, 0 if more are needed to tell
+size_t npy_header_size(const unsigned char* buffer, size_t available) {
+    if(available < 10) return 0;
+    if(buffer[6] == 1) return 10 + read_u16(buffer + 8);
+    if(available < 12) return 0;
+    return 12 + read_u32(buffer + 8);
+}
+
+//first bytes of a member, up to and including its npy header. deflated members are inflated only that far
+std::vector<unsigned char> read_member_npy_header(FILE* fp, uint64_t data_offset, uint64_t stored_size, bool deflated) {
+    std::vector<unsigned char> header;
+    if(!deflated) {
+        PhaseTimer timer(cnpy::PHASE_READ);
+        size_t want = (size_t) std::min<uint64_t>(stored_size, 256);
+        header.resize(want);
+        if(!read_at(fp, data_offset, &header[0], want)) throw std::runtime_error("npz_list: failed fread");
+        size_t needed = npy_header_size(&header[0], header.size());
+        if(needed == 0 || needed > stored_size) throw std::runtime_error("npz_list: truncated npy header");
+        if(needed > header.size()) {
+            header.resize(needed);
+            if(!read_at(fp, data_offset + want, &header[want], needed - want)) throw std::runtime_error("npz_list: failed fread");
+        }
+        timer.add_bytes(header.size());
+        return header;
+    }
+
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if(inflateInit2(&stream, -MAX_WBITS) != Z_OK) throw std::runtime_error("npz_list: inflateInit2 failed");
+    std::vector<unsigned char> input(512);
+    uint64_t consumed = 0;
+    size_t needed = 0;
+    header.resize(256);
+    int err = Z_OK;
+    while(needed == 0 || stream.total_out < needed) {
+        if(stream.avail_in == 0) {
+            size_t chunk = (size_t) std::min<uint64_t>(input.size(), stored_size - consumed);
+            if(chunk == 0) break;
+            PhaseTimer timer(cnpy::PHASE_READ, chunk);
+            if(!read_at(fp, data_offset + consumed, &input[0], chunk)) break;
+            consumed += chunk;
+            stream.next_in = &input[0];
+            stream.avail_in = (uInt) chunk;
+        }
+        if(stream.total_out == header.size()) header.resize(header.size() * 2);
+        stream.next_out = &header[stream.total_out];
+        stream.avail_out = (uInt) (header.size() - stream.total_out);
+        {
+            PhaseTimer timer(cnpy::PHASE_DECOMPRESS);
+            uLong produced_before = stream.total_out;
+            err = inflate(&stream, Z_SYNC_FLUSH);
+            timer.add_bytes(stream.total_out - produced_before);
+        }
+        if(err != Z_OK && err != Z_BUF_ERROR) break;
+        if(needed == 0) needed = npy_header_size(&header[0], stream.total_out);
+        if(needed > header.size()) header.resize(needed);
+    }
+    size_t produced = stream.total_out;
+    inflateEnd(&stream);
+    if(needed == 0 || produced < needed) throw std::runtime_error("npz_list: failed to inflate npy header");
+    header.resize(needed);
+    return header;
+}
+
+void fill_npy_info(const unsigned char* header, size_t header_size, cnpy::NpyInfo& info) {
+    size_t parsed_size;
+    cnpy::parse_npy_header(header, header_size, info.word_size, info.shape, info.fortran_order, info.dtype, parsed_size);
+    info.num_vals = std::accumulate(info.shape.begin(), info.shape.end(), (size_t)1, std::multiplies<size_t>());
+    info.num_bytes = info.num_vals * info.word_size;
+}
+
+bool has_suffix(const std::string& text, const std::string& suffix) {
+    return text.size() >= suffix.size() && text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+#ifndef _WIN32
+//array files below dir. symlinks are followed, but every directory is entered once (by device and inode),
+//so links back up the tree end the walk. directories that cannot be read end up in errors
+void collect_array_files(const std::string& dir, bool recursive, std::vector<std::string>& paths,
+    std::vector<cnpy::ScanResult>& errors, std::set<std::pair<dev_t, ino_t>>& visited)
+{
+    struct stat dir_stat;
+    DIR* handle = NULL;
+    if(stat(dir.c_str(), &dir_stat) == 0) {
+        if(!visited.insert(std::make_pair(dir_stat.st_dev, dir_stat.st_ino)).second) return;
+        handle = opendir(dir.c_str());
+    }
+    if(!handle) {
+        cnpy::ScanResult result;
+        result.path = dir;
+        result.error = "scan_directory: Unable to open directory "+dir+": "+strerror(errno);
+        errors.push_back(result);
+        return;
+    }
+    std::vector<std::string> subdirs;
+    while(struct dirent* entry = readdir(handle)) {
+        std::string name = entry->d_name;
+        if(name == "." || name == "..") continue;
+        std::string path = dir + "/" + name;
+        bool is_dir = false, is_file = false;
+#ifdef DT_DIR
+        if(entry->d_type == DT_DIR) is_dir = true;
+        else if(entry->d_type == DT_REG) is_file = true;
+        else
+#endif
+        {
+            struct stat path_stat;
+            if(stat(path.c_str(), &path_stat) == 0) {
+                is_dir = S_ISDIR(path_stat.st_mode);
+                is_file = S_ISREG(path_stat.st_mode);
+            }
+        }
+        if(is_dir && recursive) subdirs.push_back(path);
+        else if(is_file && (has_suffix(name, ".npy") || has_suffix(name, ".npz"))) paths.push_back(path);
+    }
+    closedir(handle);
+    for(size_t i = 0; i < subdirs.size(); i++) collect_array_files(subdirs[i], recursive, paths, errors, visited);
+}
+#endif
+
+} // namespace
+
+cnpy::NpyInfo cnpy::npy_info(const std::string& fname) {
+    MetricsPathScope path_scope(fname);
+    FileCloser closer{NULL};
+    {
+        PhaseTimer timer(PHASE_OPEN);
+        closer.fp = fopen(fname.c_str(), "rb");
+    }
+    if(!closer.fp) throw std::runtime_error("npy_info: Unable to open file "+fname);
+    NpyInfo info;
+    parse_npy_header(closer.fp, info.word_size, info.shape, info.fortran_order, info.dtype);
+    info.num_vals = std::accumulate(info.shape.begin(), info.shape.end(), (size_t)1, std::multiplies<size_t>());
+    info.num_bytes = info.num_vals * info.word_size;
+    info.data_offset = (uint64_t) ftello(closer.fp);
+    info.compressed_bytes = info.data_offset + info.num_bytes;
+    return info;
+}
+
+std::vector<cnpy::NpyInfo> cnpy::npz_list(const std::string& fname) {
+    MetricsPathScope path_scope(fname);
+    FileCloser closer{NULL};
+    {
+        PhaseTimer timer(PHASE_OPEN);
+        closer.fp = fopen(fname.c_str(), "rb");
+    }
+    if(!closer.fp) throw std::runtime_error("npz_list: Unable to open file "+fname);
+
+    uint64_t directory_offset, directory_size;
+    std::vector<ZipDirectoryEntry> entries = read_zip_directory(closer.fp, directory_offset, directory_size);
+    std::vector<NpyInfo> infos;
+    for(size_t i = 0; i < entries.size(); i++) {
+        const ZipDirectoryEntry& entry = entries[i];
+        NpyInfo info;
+        info.name = has_suffix(entry.name, ".npy") ? entry.name.substr(0, entry.name.size() - 4) : entry.name;
+        info.compressed = entry.compression_method != 0;
+        info.compressed_bytes = entry.compressed_size;
+        info.data_offset = zip_member_data_offset(closer.fp, entry);
+        std::vector<unsigned char> header = read_member_npy_header(closer.fp, info.data_offset, entry.compressed_size, info.compressed);
+        fill_npy_info(&header[0], header.size(), info);
+        infos.push_back(info);
+    }
+    return infos;
+}
+
+std::vector<cnpy::ScanResult> cnpy::scan_directory(const std::string& dir, bool recursive, size_t num_threads) {
+#ifdef _WIN32
+    (void) dir; (void) recursive; (void) num_threads;
+    throw std::runtime_error("scan_directory: not supported on this platform");
+#else
+    std::vector<std::string> paths;
+    std::vector<ScanResult> directory_errors;
+    std::set<std::pair<dev_t, ino_t>> visited;
+    collect_array_files(dir, recursive, paths, directory_errors, visited);
+    std::sort(paths.begin(), paths.end());
+
+    std::vector<ScanResult> results(paths.size());
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        for(size_t i = next++; i < paths.size(); i = next++) {
+            results[i].path = paths[i];
+            try {
+                if(has_suffix(paths[i], ".npy")) results[i].arrays.push_back(npy_info(paths[i]));
+                else results[i].arrays = npz_list(paths[i]);
+            } catch(const std::exception& e) {
+                results[i].arrays.clear();
+                results[i].error = e.what();
+            }
+        }
+    };
+
+    if(num_threads == 0) num_threads = std::max(1u, std::thread::hardware_concurrency());
+    num_threads = std::min(num_threads, std::max<size_t>(paths.size(), 1));
+    std::vector<std::thread> threads;
+    for(size_t i = 1; i < num_threads; i++) threads.push_back(std::thread(worker));
+    worker();
+    for(size_t i = 0; i < threads.size(); i++) threads[i].join();
+    results.insert(results.end(), directory_errors.begin(), directory_errors.end());
+    return results;
+#endif
+}
+
+struct cnpy::NpyDataset::Impl {
+    struct Shard {
+        Shard() : fd(-1), data_offset(0), first_row(0), rows(0), file_size(0) { }
+        std::string path;
+        int fd;
+        uint64_t data_offset;   //file offset of row 0
+        size_t first_row;       //global index of row 0
+        size_t rows;
+        uint64_t file_size;
+        std::once_flag map_once;
+        std::shared_ptr<char> mapping;
+    };
+
+    //the shards and the row layout. prefetches hold on to this rather than to the Impl, which owns their futures
+    struct Table {
+        ~Table() {
+#ifndef _WIN32
+            for(size_t i = 0; i < shards.size(); i++)
+                if(shards[i]->fd >= 0) close(shards[i]->fd);
+#endif
+        }
+
+        std::vector<std::unique_ptr<Shard>> shards;
+        std::vector<size_t> shape;
+        size_t word_size = 0;
+        size_t row_bytes = 0;
+        NPY_TYPE dtype = NPY_NOTYPE;
+
+        void add_shard(const std::string& path, const NpyInfo& info, uint64_t data_offset) {
+            if(info.shape.empty()) throw std::runtime_error("NpyDataset: "+path+" holds a 0-d array");
+            if(info.fortran_order && info.shape.size() > 1) throw std::runtime_error("NpyDataset: "+path+" is in fortran order");
+            std::vector<size_t> trailing(info.shape.begin() + 1, info.shape.end());
+            if(shards.empty()) {
+                shape = info.shape;
+                shape[0] = 0;
+                word_size = info.word_size;
+                dtype = info.dtype;
+                row_bytes = word_size * std::accumulate(trailing.begin(), trailing.end(), (size_t)1, std::multiplies<size_t>());
+            } else if(info.dtype != dtype || info.word_size != word_size || std::vector<size_t>(shape.begin() + 1, shape.end()) != trailing) {
+                throw std::runtime_error("NpyDataset: "+path+" does not match the dtype or trailing shape of the first shard");
+            }
+            std::unique_ptr<Shard> shard(new Shard());
+            shard->path = path;
+            shard->data_offset = data_offset;
+            shard->first_row = shape[0];
+            shard->rows = info.shape[0];
+#ifdef _WIN32
+            throw std::runtime_error("NpyDataset: not supported on this platform");
+#else
+            shard->fd = open(path.c_str(), O_RDONLY);
+            if(shard->fd < 0) throw std::runtime_error("NpyDataset: Unable to open file "+path);
+            struct stat file_stat;
+            fstat(shard->fd, &file_stat);
+            shard->file_size = file_stat.st_size;
+            if(data_offset + (uint64_t) shard->rows * row_bytes > shard->file_size)
+                throw std::runtime_error("NpyDataset: "+path+" is shorter than its header says");
+#endif
+            shape[0] += shard->rows;
+            shards.push_back(std::move(shard));
+        }
+
+        //shard holding global row
+        size_t shard_of(size_t row) const {
+            size_t lo = 0, hi = shards.size();
+            while(hi - lo > 1) {
+                size_t mid = (lo + hi) / 2;
+                if(shards[mid]->first_row <= row) lo = mid; else hi = mid;
+            }
+            return lo;
+        }
+
+        void read_span(const Shard& shard, size_t first, size_t count, char* out) const {
+#ifndef _WIN32
+            PhaseTimer timer(PHASE_READ, count * row_bytes);
+            size_t remaining = count * row_bytes;
+            off_t offset = (off_t) (shard.data_offset + (uint64_t) first * row_bytes);
+            while(remaining > 0) {
+                ssize_t got = pread(shard.fd, out, remaining, offset);
+                if(got < 0 && errno == EINTR) continue;
+                if(got <= 0) throw std::runtime_error("NpyDataset: failed pread from "+shard.path);
+                out += got;
+                remaining -= got;
+                offset += got;
+            }
+#else
+            (void) shard; (void) first; (void) count; (void) out;
+#endif
+        }
+
+        void gather(const std::vector<size_t>& rows, char* out) const {
+            if(row_bytes == 0) return;
+            //visit rows in file order so neighbouring requests turn into one read
+            std::vector<std::pair<size_t, size_t>> order(rows.size());
+            for(size_t i = 0; i < rows.size(); i++) {
+                if(rows[i] >= shape[0]) throw std::runtime_error("NpyDataset: row "+std::to_string(rows[i])+" out of range");
+                order[i] = std::make_pair(rows[i], i);
+            }
+            std::sort(order.begin(), order.end());
+
+            //rows closer than this are read together, the gap is read and dropped. one read covers at most
+            //max_span_rows, so sparse requests over a large shard do not read (and buffer) all of it
+            const size_t max_gap_rows = std::max<size_t>((64 << 10) / row_bytes, 1);
+            const size_t max_span_rows = std::max<size_t>((4 << 20) / row_bytes, 1);
+            std::vector<char> scratch;
+            size_t i = 0;
+            while(i < order.size()) {
+                size_t shard_index = shard_of(order[i].first);
+                const Shard& shard = *shards[shard_index];
+                size_t shard_end = shard.first_row + shard.rows;
+                size_t j = i + 1;
+                bool direct = true;   //span rows land in consecutive output slots
+                while(j < order.size() && order[j].first < shard_end && order[j].first - order[j-1].first <= max_gap_rows
+                    && order[j].first - order[i].first < max_span_rows) {
+                    if(order[j].first != order[j-1].first + 1 || order[j].second != order[j-1].second + 1) direct = false;
+                    j++;
+                }
+                size_t first = order[i].first, count = order[j-1].first - first + 1;
+                if(direct) {
+                    read_span(shard, first - shard.first_row, count, out + order[i].second * row_bytes);
+                } else {
+                    scratch.resize(count * row_bytes);
+                    read_span(shard, first - shard.first_row, count, &scratch[0]);
+                    for(size_t k = i; k < j; k++)
+                        memcpy(out + order[k].second * row_bytes, &scratch[(order[k].first - first) * row_bytes], row_bytes);
+                }
+                i = j;
+            }
+        }
+
+        NpyArray gather(const std::vector<size_t>& rows) const {
+            std::vector<size_t> batch_shape = shape;
+            batch_shape[0] = rows.size();
+            NpyArray batch(batch_shape, word_size, false, dtype);
+            gather(rows, batch.data<char>());
+            return batch;
+        }
+    };
+
+    std::shared_ptr<Table> table = std::make_shared<Table>();
+
+    std::mutex prefetch_mutex;
+    std::vector<size_t> prefetch_rows;
+    std::shared_future<NpyArray> prefetch_result;
+    std::shared_ptr<std::atomic<bool>> prefetch_cancelled;
+
+    ~Impl() {
+        if(prefetch_cancelled) prefetch_cancelled->store(true);
+    }
+};
+
+cnpy::NpyDataset cnpy::NpyDataset::from_npy_files(const std::vector<std::string>& fnames) {
+    std::shared_ptr<Impl> impl(new Impl());
+    for(size_t i = 0; i < fnames.size(); i++) {
+        NpyInfo info = npy_info(fnames[i]);
+        impl->table->add_shard(fnames[i], info, info.data_offset);
+    }
+    if(impl->table->shards.empty()) throw std::runtime_error("NpyDataset: no shards");
+    return NpyDataset(impl);
+}
+
+cnpy::NpyDataset cnpy::NpyDataset::from_npz(const std::string& zipname, const std::vector<std::string>& varnames) {
+    std::vector<NpyInfo> members = npz_list(zipname);
+    std::vector<NpyInfo> selected;
+    if(varnames.empty()) selected = members;
+    for(size_t v = 0; v < varnames.size(); v++) {
+        size_t m = 0;
+        while(m < members.size() && members[m].name != varnames[v]) m++;
+        if(m == members.size()) throw std::runtime_error("NpyDataset: variable not found: "+varnames[v]);
+        selected.push_back(members[m]);
+    }
+    std::shared_ptr<Impl> impl(new Impl());
+    for(size_t i = 0; i < selected.size(); i++) {
+        if(selected[i].compressed)
+            throw std::runtime_error("NpyDataset: member "+selected[i].name+" is compressed, only stored members can be read in place");
+        //npz_list points at the npy header of a member, the payload follows it
+        impl->table->add_shard(zipname, selected[i], selected[i].data_offset + selected[i].compressed_bytes - selected[i].num_bytes);
+    }
+    if(impl->table->shards.empty()) throw std::runtime_error("NpyDataset: no shards");
+    return NpyDataset(impl);
+}
+
+const std::vector<size_t>& cnpy::NpyDataset::shape() const { return impl->table->shape; }
+size_t cnpy::NpyDataset::num_rows() const { return impl->table->shape[0]; }
+size_t cnpy::NpyDataset::row_bytes() const { return impl->table->row_bytes; }
+size_t cnpy::NpyDataset::word_size() const { return impl->table->word_size; }
+cnpy::NPY_TYPE cnpy::NpyDataset::dtype() const { return impl->table->dtype; }
+size_t cnpy::NpyDataset::num_shards() const { return impl->table->shards.size(); }
+
+void cnpy::NpyDataset::gather(const std::vector<size_t>& rows, char* out) const {
+    impl->table->gather(rows, out);
+}
+
+cnpy::NpyArray cnpy::NpyDataset::gather(const std::vector<size_t>& rows) const {
+    std::shared_future<NpyArray> pending;
+    {
+        std::lock_guard<std::mutex> lock(impl->prefetch_mutex);
+        if(impl->prefetch_result.valid() && impl->prefetch_rows == rows) {
+            pending = impl->prefetch_result;
+            impl->prefetch_result = std::shared_future<NpyArray>();
+            impl->prefetch_rows.clear();
+            impl->prefetch_cancelled.reset();
+        }
+    }
+    if(pending.valid()) return pending.get();
+    return impl->table->gather(rows);
+}
+
+void cnpy::NpyDataset::prefetch(const std::vector<size_t>& rows) const {
+    //the task keeps only the table alive: an Impl that held its own future through the task would never be freed.
+    //it runs on a detached thread and its future comes from a packaged_task, not std::async, so dropping an
+    //unfinished prefetch never waits for it. one that is replaced or dropped before it starts skips the gather
+    std::shared_ptr<const Impl::Table> table = impl->table;
+    std::shared_ptr<std::atomic<bool>> cancelled = std::make_shared<std::atomic<bool>>(false);
+    std::packaged_task<NpyArray()> task([table, rows, cancelled]() -> NpyArray {
+        if(cancelled->load()) return NpyArray();
+        return table->gather(rows);
+    });
+    std::shared_future<NpyArray> result = task.get_future().share();
+    std::thread(std::move(task)).detach();
+    std::lock_guard<std::mutex> lock(impl->prefetch_mutex);
+    if(impl->prefetch_cancelled) impl->prefetch_cancelled->store(true);
+    impl->prefetch_rows = rows;
+    impl->prefetch_result = result;
+    impl->prefetch_cancelled = cancelled;
+}
+
+cnpy::NpyArray cnpy::NpyDataset::view(size_t begin, size_t end) const {
+    if(begin > end || end > impl->table->shape[0]) throw std::runtime_error("NpyDataset: view out of range");
+    if(begin == end) {
+        std::vector<size_t> empty_shape = impl->table->shape;
+        empty_shape[0] = 0;
+        return NpyArray(empty_shape, impl->table->word_size, false, impl->table->dtype);
+    }
+    Impl::Shard& shard = *impl->table->shards[impl->table->shard_of(begin)];
+    if(end > shard.first_row + shard.rows) throw std::runtime_error("NpyDataset: view crosses a shard boundary");
+#ifdef _WIN32
+    throw std::runtime_error("NpyDataset: not supported on this platform");
+#else
+    std::call_once(shard.map_once, [&shard]() {
+        void* address = mmap(NULL, shard.file_size, PROT_READ, MAP_SHARED, shard.fd, 0);
+        if(address == MAP_FAILED) throw std::runtime_error("NpyDataset: unable to map "+shard.path);
+        size_t size = shard.file_size;
+        shard.mapping = std::shared_ptr<char>(static_cast<char*>(address), [size](char* p) { munmap(p, size); });
+    });
+    std::vector<size_t> view_shape = impl->table->shape;
+    view_shape[0] = end - begin;
+    std::shared_ptr<char> data(shard.mapping, shard.mapping.get() + shard.data_offset + (begin - shard.first_row) * impl->table->row_bytes);
+    return NpyArray(view_shape, impl->table->word_size, false, impl->table->dtype, data);
+#endif
+}
+
+namespace {
+
+//end of the bytes a member occupies: local header, data and an optional data descriptor
+uint64_t zip_member_end(FILE* fp, const ZipDirectoryEntry& entry) {
+    uint64_t end = zip_member_data_offset(fp, entry) + entry.compressed_size;
+    if(entry.flags & 8) {
+        unsigned char signature[4];
+        bool has_signature = read_at(fp, end, signature, 4) && read_u32(signature) == 0x08074b50;
+        bool zip64 = entry.compressed_size >= 0xFFFFFFFF || entry.uncompressed_size >= 0xFFFFFFFF;
+        end += (has_signature ? 4 : 0) + 4 + (zip64 ? 16 : 8);
+    }
+    return end;
+}
+
+#ifndef _WIN32
+//moves byte_count bytes of fd from src down to dst < src. ranges may overlap, so they are moved front to back
+//in pieces that do not overlap: copy_file_range where the kernel has it, pread/pwrite otherwise
+void move_range_down(int fd, uint64_t src, uint64_t dst, uint64_t byte_count, const std::string& fname) {
+    std::vector<char> buffer;
+    while(byte_count > 0) {
+        size_t chunk = (size_t) std::min<uint64_t>(std::min<uint64_t>(byte_count, src - dst), 64 << 20);
+#ifdef __linux__
+        off_t in_offset = (off_t) src, out_offset = (off_t) dst;
+        ssize_t copied;
+        {
+            PhaseTimer timer(cnpy::PHASE_WRITE);
+            copied = copy_file_range(fd, &in_offset, fd, &out_offset, chunk, 0);
+            if(copied > 0) timer.add_bytes(copied);
+        }
+        if(copied > 0) {
+            src += copied;
+            dst += copied;
+            byte_count -= copied;
+            continue;
+        }
+#endif
+        chunk = std::min<size_t>(chunk, 1 << 20);
+        buffer.resize(chunk);
+        ssize_t got;
+        {
+            PhaseTimer timer(cnpy::PHASE_READ, chunk);
+            got = pread(fd, &buffer[0], chunk, (off_t) src);
+        }
+        if(got <= 0) {
+            if(got < 0 && errno == EINTR) continue;
+            throw std::runtime_error("npz_compact: failed to read "+fname);
+        }
+        pwrite_all(fd, &buffer[0], (size_t) got, (off_t) dst);
+        src += got;
+        dst += got;
+        byte_count -= got;
+    }
+}
+#endif
+
+} // namespace
+
+void cnpy::npz_replace_member(const std::string& zipname, const std::string& varname, const std::vector<char>& npy_header, const StridedSource& payload, bool atomic) {
+    FileCloser existing{fopen(zipname.c_str(), "rb")};
+    if(!existing.fp) {
+        npz_add_member(zipname, varname, npy_header, payload, false, atomic);
+        return;
+    }
+    MetricsPathScope path_scope(zipname);
+    uint64_t directory_offset, directory_size;
+    std::vector<ZipDirectoryEntry> entries = read_zip_directory(existing.fp, directory_offset, directory_size);
+
+    ZipDirectoryEntry member = ZipDirectoryEntry();
+    member.name = varname + ".npy";
+    member.compressed_size = member.uncompressed_size = npy_header.size() + payload.num_bytes();
+    std::vector<char> local_header;
+    put_local_header(local_header, member);
+
+    //every copy of the member is dropped. the new one takes the place of the first copy whose bytes can hold it
+    std::vector<ZipDirectoryEntry> kept;
+    size_t position = std::string::npos;
+    bool in_place = false;
+    for(size_t i = 0; i < entries.size(); i++) {
+        if(entries[i].name != member.name) {
+            kept.push_back(entries[i]);
+            continue;
+        }
+        if(position == std::string::npos) position = kept.size();
+        if(!atomic && !in_place && zip_member_end(existing.fp, entries[i]) - entries[i].local_header_offset >= local_header.size() + member.compressed_size) {
+            in_place = true;
+            member.local_header_offset = entries[i].local_header_offset;
+        }
+    }
+    if(position == std::string::npos) position = kept.size();
+    kept.insert(kept.begin() + position, member);
+
+    std::unique_ptr<FileSink> sink = open_for_edit(zipname, existing, directory_offset, atomic);
+    if(!in_place) kept[position].local_header_offset = directory_offset;
+    write_stored_member(*sink, kept[position], npy_header, payload);
+    if(!in_place) directory_offset = kept[position].local_header_offset + local_header.size() + member.compressed_size;
+    sink->seek(directory_offset, SEEK_SET);
+    write_zip_directory(*sink, kept, directory_offset);
+    sink->truncate();
+    sink->commit();
+}
+
+void cnpy::npz_remove(const std::string& zipname, const std::string& varname, bool atomic) {
+    FileCloser existing{fopen(zipname.c_str(), "rb")};
+    if(!existing.fp) throw std::runtime_error("npz_remove: Unable to open file "+zipname);
+    MetricsPathScope path_scope(zipname);
+    uint64_t directory_offset, directory_size;
+    std::vector<ZipDirectoryEntry> entries = read_zip_directory(existing.fp, directory_offset, directory_size);
+
+    std::vector<ZipDirectoryEntry> kept;
+    for(size_t i = 0; i < entries.size(); i++)
+        if(entries[i].name != varname + ".npy") kept.push_back(entries[i]);
+    if(kept.size() == entries.size()) throw std::runtime_error("npz_remove: Variable name "+varname+" not found in "+zipname);
+
+    std::unique_ptr<FileSink> sink = open_for_edit(zipname, existing, directory_offset, atomic);
+    write_zip_directory(*sink, kept, directory_offset);
+    sink->truncate();
+    sink->commit();
+}
+
+uint64_t cnpy::npz_compact(const std::string& zipname, bool atomic) {
+    FileCloser existing{fopen(zipname.c_str(), "rb")};
+    if(!existing.fp) throw std::runtime_error("npz_compact: Unable to open file "+zipname);
+    MetricsPathScope path_scope(zipname);
+    uint64_t directory_offset, directory_size;
+    std::vector<ZipDirectoryEntry> entries = read_zip_directory(existing.fp, directory_offset, directory_size);
+    fseek(existing.fp, 0, SEEK_END);
+    uint64_t old_size = (uint64_t) ftello(existing.fp);
+
+    //live members in file order, each to be slid down against the previous one
+    std::vector<std::pair<uint64_t, size_t>> order;
+    std::vector<uint64_t> ends(entries.size());
+    for(size_t i = 0; i < entries.size(); i++) {
+        order.push_back(std::make_pair(entries[i].local_header_offset, i));
+        ends[i] = zip_member_end(existing.fp, entries[i]);
+    }
+    std::sort(order.begin(), order.end());
+    for(size_t k = 1; k < order.size(); k++)
+        if(order[k].first < ends[order[k-1].second]) throw std::runtime_error("npz_compact: overlapping members in "+zipname);
+
+    uint64_t cursor = 0;
+    std::unique_ptr<FileSink> sink;
+    if(atomic) {
+        sink.reset(new FileSink(zipname, true));
+        for(size_t k = 0; k < order.size(); k++) {
+            ZipDirectoryEntry& entry = entries[order[k].second];
+            uint64_t size = ends[order[k].second] - entry.local_header_offset;
+            sink->copy_from(existing.fp, entry.local_header_offset, size);
+            entry.local_header_offset = cursor;
+            cursor += size;
+        }
+    } else {
+#ifdef _WIN32
+        throw std::runtime_error("npz_compact: in place compaction is not supported on this platform");
+#else
+        fclose(existing.fp);
+        existing.fp = NULL;
+        int fd = open(zipname.c_str(), O_RDWR);
+        if(fd < 0) throw std::runtime_error("npz_compact: Unable to open file "+zipname+": "+strerror(errno));
+        try {
+            for(size_t k = 0; k < order.size(); k++) {
+                ZipDirectoryEntry& entry = entries[order[k].second];
+                uint64_t size = ends[order[k].second] - entry.local_header_offset;
+                if(entry.local_header_offset != cursor) move_range_down(fd, entry.local_header_offset, cursor, size, zipname);
+                entry.local_header_offset = cursor;
+                cursor += size;
+            }
+        } catch(...) {
+            close(fd);
+            throw;
+        }
+        close(fd);
+        sink.reset(new FileSink(zipname, false, true));
+        sink->seek(cursor, SEEK_SET);
+#endif
+    }
+    write_zip_directory(*sink, entries, cursor);
+    sink->truncate();
+    sink->commit();
+
+    struct stat compacted;
+    if(stat(zipname.c_str(), &compacted) != 0) return 0;
+    return old_size > (uint64_t) compacted.st_size ? old_size - (uint64_t) compacted.st_size : 0;
+}
@@ -15,9 +15,15 @@
 #include<cassert>
 #include<zlib.h>
 #include<map>
+#include<list>
 #include<memory>
 #include<stdint.h>
+#include<cstddef>
+#if __cplusplus >= 201703L
+#include<string_view>
+#endif
 #include<numeric>
+#include<functional>
 
 namespace cnpy {
 
@@ -69,18 +75,27 @@ namespace cnpy {
             for(size_t i = 0;i < shape.size();i++) num_vals *= shape[i];
             data_holder = std::shared_ptr<std::vector<char>>(
                 new std::vector<char>(num_vals * word_size));
+            data_ptr = std::shared_ptr<char>(data_holder, data_holder->data());
+        }
+
+        //view of memory owned by someone else: data_ptr keeps the owner alive, data_holder stays empty
+        NpyArray(const std::vector<size_t>& _shape, size_t _word_size, bool _fortran_order, NPY_TYPE _dtype, std::shared_ptr<char> _data) :
+            data_ptr(_data), shape(_shape), word_size(_word_size), fortran_order(_fortran_order), dtype(_dtype)
+        {
+            num_vals = 1;
+            for(size_t i = 0;i < shape.size();i++) num_vals *= shape[i];
         }
 
         NpyArray() : shape(0), word_size(0), fortran_order(0), num_vals(0) { }
 
         template<typename T>
         T* data() {
-            return reinterpret_cast<T*>(&(*data_holder)[0]);
+            return reinterpret_cast<T*>(data_ptr.get());
         }
 
         template<typename T>
         const T* data() const {
-            return reinterpret_cast<T*>(&(*data_holder)[0]);
+            return reinterpret_cast<T*>(data_ptr.get());
         }
 
         template<typename T>
@@ -90,29 +105,278 @@ namespace cnpy {
         }
 
         size_t num_bytes() const {
-            return data_holder->size();
+            return num_vals * word_size;
         }
 
+        //element i of an NPY_STRING array, without its NUL padding. points into the array, no copy is made
+        const char* string_data(size_t i, size_t& length) const {
+            const char* p = data<char>() + i * word_size;
+            length = word_size;
+            while(length > 0 && p[length-1] == '\0') length--;
+            return p;
+        }
+
+#if __cplusplus >= 201703L
+        std::string_view string_view_at(size_t i) const {
+            size_t length;
+            const char* p = string_data(i, length);
+            return std::string_view(p, length);
+        }
+#endif
+
+        //element i of an NPY_STRING or NPY_UNICODE array; unicode is converted to UTF-8
+        std::string string_at(size_t i) const;
+        std::vector<std::string> as_strings() const;
+
         std::shared_ptr<std::vector<char>> data_holder;
+        std::shared_ptr<char> data_ptr;
         std::vector<size_t> shape;
         size_t word_size;
         bool fortran_order;
         NPY_TYPE dtype;
         size_t num_vals;
     };
-   
+
     using npz_t = std::map<std::string, NpyArray>; 
 
+    struct ParallelWriteOptions {
+        //number of writer threads, 0 picks std::thread::hardware_concurrency()
+        size_t num_threads = 0;
+        //payload is split at file offsets that are multiples of chunk_size (rounded up to 4 KiB)
+        size_t chunk_size = size_t(64) << 20;
+        //called after every finished chunk, never concurrently
+        std::function<void(size_t bytes_written, size_t total_bytes, double elapsed_seconds)> progress;
+    };
+
+    //payload of a save that need not be contiguous: element (i0, i1, ...) starts at
+    //base + i0*byte_strides[0] + i1*byte_strides[1] + ...; it is written in C order, or fortran order if requested
+    struct StridedSource {
+        const char* base;
+        std::vector<size_t> shape;
+        std::vector<ptrdiff_t> byte_strides;
+        size_t word_size;
+        bool fortran_order;
+
+        static StridedSource contiguous(const char* data, size_t byte_count) {
+            StridedSource source = {data, std::vector<size_t>(1, byte_count), std::vector<ptrdiff_t>(1, 1), 1, false};
+            return source;
+        }
+
+        size_t num_bytes() const {
+            return word_size * std::accumulate(shape.begin(), shape.end(), (size_t)1, std::multiplies<size_t>());
+        }
+    };
+
+    //writev-style output: segments either point into caller memory (the array payload) or into storage.
+    //move-only, so the segment pointers into storage stay valid.
+    struct ScatterBuffer {
+        ScatterBuffer() { }
+        ScatterBuffer(ScatterBuffer&&) = default;
+        ScatterBuffer& operator=(ScatterBuffer&&) = default;
+        ScatterBuffer(const ScatterBuffer&) = delete;
+        ScatterBuffer& operator=(const ScatterBuffer&) = delete;
+
+        void append_copy(std::vector<char> bytes) {
+            storage.push_back(std::move(bytes));
+            segments.push_back(std::make_pair(storage.back().data(), storage.back().size()));
+        }
+
+        void append_reference(const char* bytes, size_t byte_count) {
+            segments.push_back(std::make_pair(bytes, byte_count));
+        }
+
+        size_t num_bytes() const {
+            size_t total = 0;
+            for(size_t i = 0; i < segments.size(); i++) total += segments[i].second;
+            return total;
+        }
+
+        std::vector<std::pair<const char*, size_t>> segments;
+        std::list<std::vector<char>> storage;
+    };
+
+    struct ArrayCacheStats {
+        size_t hits = 0;
+        size_t misses = 0;
+        size_t evictions = 0;
+        size_t entries = 0;
+        size_t bytes = 0;
+        size_t capacity = 0;
+    };
+
+    //what npy_info/npz_list learn from the headers alone
+    struct NpyInfo {
+        std::string name;               //member name for npz archives, empty for npy files
+        std::vector<size_t> shape;
+        size_t word_size = 0;
+        bool fortran_order = false;
+        NPY_TYPE dtype = NPY_NOTYPE;
+        size_t num_vals = 0;
+        size_t num_bytes = 0;           //payload size, without the npy header
+        uint64_t data_offset = 0;       //file offset of the npy header of a member (of the payload for npy files)
+        bool compressed = false;
+        uint64_t compressed_bytes = 0;  //stored size of the member or npy file, npy header included
+    };
+
+    struct ScanResult {
+        std::string path;
+        std::vector<NpyInfo> arrays;
+        std::string error;              //set instead of arrays when the file (or directory) could not be read
+    };
+
+    //phases timed by the optional instrumentation (see metrics_enable)
+    enum MetricsPhase {
+        PHASE_OPEN = 0,
+        PHASE_HEADER_PARSE, //reading and parsing npy headers
+        PHASE_READ,
+        PHASE_DECOMPRESS,
+        PHASE_CRC,
+        PHASE_WRITE,
+        PHASE_FSYNC,
+        PHASE_DIRECTORY,    //zip footer, central directory and local header walks
+        PHASE_COUNT
+    };
+
+    struct MetricsEvent {
+        MetricsPhase phase;
+        uint64_t nanoseconds;
+        uint64_t bytes;
+        const char* path;   //file the phase worked on, NULL when not known. only valid during the callback
+    };
+
+    struct PhaseMetrics {
+        uint64_t calls = 0;
+        uint64_t total_nanoseconds = 0;
+        uint64_t max_nanoseconds = 0;
+        uint64_t bytes = 0;
+        //latency_histogram[i] counts calls that took [2^i, 2^(i+1)) ns
+        std::vector<uint64_t> latency_histogram;
+    };
+
+    struct MetricsSnapshot {
+        PhaseMetrics phases[PHASE_COUNT];
+    };
+
     char BigEndianTest();
     char map_type(const std::type_info& t);
     NPY_TYPE map_type_to_npy_types(const std::type_info& t);
     template<typename T> std::vector<char> create_npy_header(const std::vector<size_t>& shape, bool fortran_order);
+    std::vector<char> create_npy_header(const std::vector<size_t>& shape, char type_char, size_t word_size, bool fortran_order);
+    //header describing an array that was loaded or built at runtime
+    std::vector<char> create_npy_header(const NpyArray& array);
     void parse_npy_header(FILE* fp, size_t& word_size, std::vector<size_t>& shape, bool& fortran_order, NPY_TYPE& type);
     void parse_npy_header(unsigned char* buffer, size_t& word_size, std::vector<size_t>& shape, bool& fortran_order, NPY_TYPE& type);
+    //bounds-checked variant, header_size receives the offset of the payload within buffer
+    void parse_npy_header(const unsigned char* buffer, size_t buffer_size, size_t& word_size, std::vector<size_t>& shape, bool& fortran_order, NPY_TYPE& type, size_t& header_size);
     void parse_zip_footer(FILE* fp, uint16_t& nrecs, size_t& global_header_size, size_t& global_header_offset);
     npz_t npz_load(std::string fname);
     NpyArray npz_load(std::string fname, std::string varname);
     NpyArray npy_load(std::string fname);
+    //load from memory. unless copy is set, the returned array aliases buffer, which must outlive it
+    NpyArray npy_loads(const char* buffer, size_t size, bool copy = false);
+    //zero-copy load whose array shares ownership of the memory through owner
+    NpyArray npy_loads(const char* buffer, size_t size, std::shared_ptr<const void> owner);
+    //stored members alias buffer unless copy is set, compressed members are always inflated into their own storage
+    npz_t npz_loads(const char* buffer, size_t size, bool copy = false);
+    NpyArray npz_loads(const char* buffer, size_t size, const std::string& varname, bool copy = false);
+    //a string literal names the variable here, it would otherwise convert to the copy flag above
+    NpyArray npz_loads(const char* buffer, size_t size, const char* varname, bool copy = false);
+    //stored members share ownership of the memory through owner instead of aliasing it
+    npz_t npz_loads(const char* buffer, size_t size, std::shared_ptr<const void> owner);
+    NpyArray npz_loads(const char* buffer, size_t size, const std::string& varname, std::shared_ptr<const void> owner);
+    //write a complete .npy file (append: rewrite the header of an existing file and add payload at its end).
+    //with atomic set, the result is built in a temporary file next to fname, synced and renamed over fname,
+    //so a crash leaves either the old or the new file, never a partial one.
+    void npy_write(const std::string& fname, const std::vector<char>& header, const char* payload, size_t payload_bytes, bool append, bool atomic);
+    void npy_write(const std::string& fname, const std::vector<char>& header, const StridedSource& payload, bool append, bool atomic);
+    //add one member (header + payload) to a zip archive, creating a new archive unless append is set.
+    //atomic works as for npy_write; appends copy the existing archive so the old one stays valid until the rename.
+    void npz_add_member(const std::string& zipname, std::string member_name, const std::vector<char>& npy_header, const char* payload, size_t payload_bytes, bool append, bool atomic);
+    //the payload is gathered into large write buffers and the CRC is computed in the same pass
+    void npz_add_member(const std::string& zipname, std::string member_name, const std::vector<char>& npy_header, const StridedSource& payload, bool append, bool atomic);
+    //editing an existing archive. every copy of varname is replaced by the new data, written over an old copy when it
+    //fits and appended otherwise; either way only the central directory is rewritten. removed and replaced members
+    //leave dead bytes behind until npz_compact slides the live members together and returns the bytes reclaimed.
+    //without atomic these edit the file in place, so a crash midway can leave it unreadable
+    void npz_replace_member(const std::string& zipname, const std::string& varname, const std::vector<char>& npy_header, const StridedSource& payload, bool atomic);
+    void npz_remove(const std::string& zipname, const std::string& varname, bool atomic = false);
+    uint64_t npz_compact(const std::string& zipname, bool atomic = false);
+    //in-memory counterpart of npz_add_member, the archive lives in (and is appended to) buffer
+    void npz_add_member(std::vector<char>& buffer, std::string member_name, const std::vector<char>& npy_header, const char* payload, size_t payload_bytes, bool append);
+    //same, with the archive kept as segments: headers and directory are copied, the payload is referenced in place
+    void npz_add_member(ScatterBuffer& archive, std::string member_name, const std::vector<char>& npy_header, const char* payload, size_t payload_bytes, bool append);
+    //metadata without reading payloads. compressed npz members are inflated only as far as their npy header
+    NpyInfo npy_info(const std::string& fname);
+    std::vector<NpyInfo> npz_list(const std::string& fname);
+    //npy_info/npz_list for every .npy and .npz file below dir, spread over num_threads (0: one per core)
+    //directories that cannot be read are reported after the files, as results with error set
+    std::vector<ScanResult> scan_directory(const std::string& dir, bool recursive = true, size_t num_threads = 0);
+    //per-phase timings and byte counts. off by default; when the library is built without
+    //CNPY_ENABLE_METRICS these do nothing and snapshots stay empty
+    void metrics_enable(bool enabled);
+    bool metrics_enabled();
+    void metrics_reset();
+    MetricsSnapshot metrics_snapshot();
+    //called for every timed phase while metrics are enabled, never concurrently and not from within a lock the
+    //caller could take, but it must not load or save through cnpy itself. pass an empty function to remove it
+    void metrics_set_callback(std::function<void(const MetricsEvent&)> callback);
+    const char* metrics_phase_name(MetricsPhase phase);
+    //opt-in process-wide cache behind the *_load_cached functions, bounded to max_bytes of array data.
+    //0 (the default) disables it and drops every entry. the cache is split into 16 LRU shards that evict in turn
+    //while the total exceeds max_bytes; a file whose arrays exceed max_bytes is loaded but not cached.
+    void cache_set_capacity(size_t max_bytes);
+    void cache_clear();
+    ArrayCacheStats cache_stats();
+    //loads that are answered from the cache while the file keeps its inode, size and mtime. the returned
+    //arrays share their data with the cache and must be treated as read-only
+    NpyArray npy_load_cached(const std::string& fname);
+    npz_t npz_load_cached(const std::string& fname);
+    NpyArray npz_load_cached(const std::string& fname, const std::string& varname);
+    //publish arrays into the named POSIX shared-memory segment (replacing any segment of that name).
+    //the segment holds a small index followed by npy-formatted members.
+    void shm_publish(const std::string& name, const npz_t& arrays);
+    void shm_publish(const std::string& name, const NpyArray& array, const std::string& varname = "arr_0");
+    //attach to a published segment. the arrays are read-only, zero-copy views that keep the mapping alive
+    npz_t shm_attach(const std::string& name);
+    NpyArray shm_attach(const std::string& name, const std::string& varname);
+    //remove the segment name, processes that are attached keep their mapping
+    void shm_remove(const std::string& name);
+    void npy_write_parallel(const std::string& fname, const std::vector<char>& header, const char* payload, size_t payload_bytes, const ParallelWriteOptions& options);
+    //save strings as a 1-d NPY_STRING (bytes) or NPY_UNICODE array, NUL padded to the longest one.
+    //unicode strings are given as UTF-8. appending to an .npy keeps the width of the existing array
+    void npy_save_strings(const std::string& fname, const std::vector<std::string>& strings, NPY_TYPE dtype = NPY_STRING, const std::string& mode = "w", bool atomic = false);
+    void npz_save_strings(const std::string& zipname, const std::string& fname, const std::vector<std::string>& strings, NPY_TYPE dtype = NPY_STRING, const std::string& mode = "w", bool atomic = false);
+
+    //npy files, or the stored members of an npz archive, that share dtype and trailing shape, seen as one
+    //C-order array concatenated along axis 0. rows are fetched with coalesced pread calls or mmap views, the
+    //payload is never loaded as a whole. copies of a dataset share the open files
+    class NpyDataset {
+    public:
+        static NpyDataset from_npy_files(const std::vector<std::string>& fnames);
+        //members in archive order when varnames is empty
+        static NpyDataset from_npz(const std::string& zipname, const std::vector<std::string>& varnames = std::vector<std::string>());
+
+        const std::vector<size_t>& shape() const;
+        size_t num_rows() const;
+        size_t row_bytes() const;
+        size_t word_size() const;
+        NPY_TYPE dtype() const;
+        size_t num_shards() const;
+
+        //copy the given rows, in the given order, into out (rows.size() * row_bytes() bytes)
+        void gather(const std::vector<size_t>& rows, char* out) const;
+        //the same as an array of shape (rows.size(), trailing shape...). picks up a matching prefetch
+        NpyArray gather(const std::vector<size_t>& rows) const;
+        //start gathering rows on a background thread, replacing any earlier prefetch without waiting for it
+        void prefetch(const std::vector<size_t>& rows) const;
+        //zero-copy read-only view of rows [begin, end), which must lie in a single shard
+        NpyArray view(size_t begin, size_t end) const;
+
+        struct Impl;
+    private:
+        explicit NpyDataset(std::shared_ptr<Impl> impl) : impl(impl) { }
+        std::shared_ptr<Impl> impl;
+    };
 
     template<typename T> std::vector<char>& operator+=(std::vector<char>& lhs, const T rhs) {
         //write in little endian
@@ -127,14 +391,13 @@ namespace cnpy {
     template<> std::vector<char>& operator+=(std::vector<char>& lhs, const char* rhs);
 
 
-    template<typename T> void npy_save(
-        std::string fname, const T* data, const std::vector<size_t> shape, std::string mode = "w",
-        bool fortran_order = false
-    ) {
+    //header for saving shape into fname; when appending to an existing file, checks that the data fits and sets append
+    template<typename T> std::vector<char> npy_save_header(const std::string& fname, const std::vector<size_t>& shape, const std::string& mode, bool fortran_order, bool& append) {
         FILE* fp = NULL;
         std::vector<size_t> true_data_shape; //if appending, the shape of existing + new data
 
-        if(mode == "a") fp = fopen(fname.c_str(),"r+b");
+        if(mode == "a") fp = fopen(fname.c_str(),"rb");
+        append = (fp != NULL);
 
         if(fp) {
             //file exists. we need to append to it. read the header, modify the array size
@@ -142,6 +405,7 @@ namespace cnpy {
             bool existing_file_fortran_order;
             NPY_TYPE type;
             parse_npy_header(fp, word_size, true_data_shape, existing_file_fortran_order, type);
+            fclose(fp);
             assert(fortran_order == existing_file_fortran_order);
 
             if(word_size != sizeof(T)) {
@@ -154,7 +418,7 @@ namespace cnpy {
             }
             if(true_data_shape.size() != shape.size()) {
                 std::cout<<"libnpy error: npy_save attempting to append misdimensioned data to "<<fname<<"\n";
-                assert(true_data_shape.size() != shape.size());
+                assert(true_data_shape.size() == shape.size());
             }
 
             for(size_t i = 1; i < shape.size(); i++) {
@@ -166,154 +430,113 @@ namespace cnpy {
             true_data_shape[0] += shape[0];
         }
         else {
-            fp = fopen(fname.c_str(),"wb");
             true_data_shape = shape;
         }
 
-        std::vector<char> header = create_npy_header<T>(true_data_shape, fortran_order);
-        size_t nels = std::accumulate(shape.begin(),shape.end(),1,std::multiplies<size_t>());
+        return create_npy_header<T>(true_data_shape, fortran_order);
+    }
+
+    template<typename T> void npy_save(
+        const std::string& fname, const T* data, const std::vector<size_t>& shape, const std::string& mode = "w",
+        bool fortran_order = false, bool atomic = false
+    ) {
+        bool append;
+        std::vector<char> header = npy_save_header<T>(fname, shape, mode, fortran_order, append);
+        size_t nels = std::accumulate(shape.begin(),shape.end(),(size_t)1,std::multiplies<size_t>());
+
+        npy_write(fname, header, reinterpret_cast<const char*>(data), nels*sizeof(T), append, atomic);
+    }
 
-        fseek(fp,0,SEEK_SET);
-        fwrite(&header[0],sizeof(char),header.size(),fp);
-        fseek(fp,0,SEEK_END);
-        fwrite(data,sizeof(T),nels,fp);
-        fclose(fp);
+    //save a strided view (e.g. a column slice) without packing it first. byte_strides has one entry per axis of shape
+    template<typename T> void npy_save_strided(
+        const std::string& fname, const T* base, const std::vector<size_t>& shape, const std::vector<ptrdiff_t>& byte_strides,
+        const std::string& mode = "w", bool fortran_order = false, bool atomic = false
+    ) {
+        if(byte_strides.size() != shape.size()) throw std::runtime_error("npy_save_strided: need one stride per axis");
+        bool append;
+        std::vector<char> header = npy_save_header<T>(fname, shape, mode, fortran_order, append);
+        StridedSource source = {reinterpret_cast<const char*>(base), shape, byte_strides, sizeof(T), fortran_order};
+        npy_write(fname, header, source, append, atomic);
     }
 
-    template<typename T> void npz_save(std::string zipname, std::string fname, const T* data, const std::vector<size_t>& shape, std::string mode = "w", bool fortran_order = false)
+    //write a new .npy file with several threads issuing pwrite on disjoint regions of a preallocated file.
+    //intended for very large arrays on storage that one sequential writer cannot saturate. always overwrites.
+    template<typename T> void npy_save_parallel(const std::string& fname, const T* data, const std::vector<size_t>& shape,
+        bool fortran_order = false, const ParallelWriteOptions& options = ParallelWriteOptions())
     {
-        //first, append a .npy to the fname
-        fname += ".npy";
+        std::vector<char> header = create_npy_header<T>(shape, fortran_order);
+        size_t nels = std::accumulate(shape.begin(),shape.end(),(size_t)1,std::multiplies<size_t>());
+        npy_write_parallel(fname, header, reinterpret_cast<const char*>(data), nels*sizeof(T), options);
+    }
 
-        //now, on with the show
-        FILE* fp = NULL;
-        uint16_t nrecs = 0;
-        size_t global_header_offset = 0;
-        std::vector<char> global_header;
+    template<typename T> void npz_save(const std::string& zipname, const std::string& fname, const T* data, const std::vector<size_t>& shape, const std::string& mode = "w", bool fortran_order = false, bool atomic = false)
+    {
+        std::vector<char> npy_header = create_npy_header<T>(shape, fortran_order);
+        size_t nels = std::accumulate(shape.begin(),shape.end(),(size_t)1,std::multiplies<size_t>());
+        npz_add_member(zipname, fname, npy_header, reinterpret_cast<const char*>(data), nels*sizeof(T), mode == "a", atomic);
+    }
 
-        if(mode == "a") fp = fopen(zipname.c_str(),"r+b");
+    template<typename T> void npz_replace(const std::string& zipname, const std::string& varname, const T* data, const std::vector<size_t>& shape, bool fortran_order = false, bool atomic = false)
+    {
+        std::vector<char> npy_header = create_npy_header<T>(shape, fortran_order);
+        size_t nels = std::accumulate(shape.begin(),shape.end(),(size_t)1,std::multiplies<size_t>());
+        npz_replace_member(zipname, varname, npy_header, StridedSource::contiguous(reinterpret_cast<const char*>(data), nels*sizeof(T)), atomic);
+    }
 
-        if(fp) {
-            //zip file exists. we need to add a new npy file to it.
-            //first read the footer. this gives us the offset and size of the global header
-            //then read and store the global header.
-            //below, we will write the the new data at the start of the global header then append the global header and footer below it
-            size_t global_header_size;
-            parse_zip_footer(fp,nrecs,global_header_size,global_header_offset);
-            fseek(fp,global_header_offset,SEEK_SET);
-            global_header.resize(global_header_size);
-            size_t res = fread(&global_header[0],sizeof(char),global_header_size,fp);
-            if(res != global_header_size){
-                throw std::runtime_error("npz_save: header read error while adding to existing zip");
-            }
-            fseek(fp,global_header_offset,SEEK_SET);
-        }
-        else {
-            fp = fopen(zipname.c_str(),"wb");
-        }
+    template<typename T> void npz_save_strided(const std::string& zipname, const std::string& fname, const T* base, const std::vector<size_t>& shape,
+        const std::vector<ptrdiff_t>& byte_strides, const std::string& mode = "w", bool fortran_order = false, bool atomic = false)
+    {
+        if(byte_strides.size() != shape.size()) throw std::runtime_error("npz_save_strided: need one stride per axis");
+        std::vector<char> npy_header = create_npy_header<T>(shape, fortran_order);
+        StridedSource source = {reinterpret_cast<const char*>(base), shape, byte_strides, sizeof(T), fortran_order};
+        npz_add_member(zipname, fname, npy_header, source, mode == "a", atomic);
+    }
+
+    template<typename T> std::vector<char> npy_dumps(const T* data, const std::vector<size_t>& shape, bool fortran_order = false) {
+        std::vector<char> buffer = create_npy_header<T>(shape, fortran_order);
+        size_t nels = std::accumulate(shape.begin(),shape.end(),(size_t)1,std::multiplies<size_t>());
+        const char* bytes = reinterpret_cast<const char*>(data);
+        buffer.insert(buffer.end(), bytes, bytes + nels*sizeof(T));
+        return buffer;
+    }
 
+    //header in its own segment, payload referenced in place. data must outlive the returned buffer
+    template<typename T> ScatterBuffer npy_dumps_scatter(const T* data, const std::vector<size_t>& shape, bool fortran_order = false) {
+        ScatterBuffer out;
+        out.append_copy(create_npy_header<T>(shape, fortran_order));
+        size_t nels = std::accumulate(shape.begin(),shape.end(),(size_t)1,std::multiplies<size_t>());
+        out.append_reference(reinterpret_cast<const char*>(data), nels*sizeof(T));
+        return out;
+    }
+
+    //npz_save into a growable buffer: "w" replaces its contents, "a" adds a member to the archive already in it
+    template<typename T> void npz_dumps(std::vector<char>& buffer, const std::string& fname, const T* data, const std::vector<size_t>& shape, const std::string& mode = "w", bool fortran_order = false) {
         std::vector<char> npy_header = create_npy_header<T>(shape, fortran_order);
+        size_t nels = std::accumulate(shape.begin(),shape.end(),(size_t)1,std::multiplies<size_t>());
+        npz_add_member(buffer, fname, npy_header, reinterpret_cast<const char*>(data), nels*sizeof(T), mode == "a" && !buffer.empty());
+    }
 
-        size_t nels = std::accumulate(shape.begin(),shape.end(),1,std::multiplies<size_t>());
-        size_t nbytes = nels*sizeof(T) + npy_header.size();
-
-        //get the CRC of the data to be added
-        uint32_t crc = crc32(0L,(uint8_t*)&npy_header[0],npy_header.size());
-        crc = crc32(crc,(uint8_t*)data,nels*sizeof(T));
-
-        //build the local header
-        std::vector<char> local_header;
-        local_header += "PK"; //first part of sig
-        local_header += (uint16_t) 0x0403; //second part of sig
-        local_header += (uint16_t) 20; //min version to extract
-        local_header += (uint16_t) 0; //general purpose bit flag
-        local_header += (uint16_t) 0; //compression method
-        local_header += (uint16_t) 0; //file last mod time
-        local_header += (uint16_t) 0;     //file last mod date
-        local_header += (uint32_t) crc; //crc
-        local_header += (uint32_t) nbytes; //compressed size
-        local_header += (uint32_t) nbytes; //uncompressed size
-        local_header += (uint16_t) fname.size(); //fname length
-        local_header += (uint16_t) 0; //extra field length
-        local_header += fname;
-
-        //build global header
-        global_header += "PK"; //first part of sig
-        global_header += (uint16_t) 0x0201; //second part of sig
-        global_header += (uint16_t) 20; //version made by
-        global_header.insert(global_header.end(),local_header.begin()+4,local_header.begin()+30);
-        global_header += (uint16_t) 0; //file comment length
-        global_header += (uint16_t) 0; //disk number where file starts
-        global_header += (uint16_t) 0; //internal file attributes
-        global_header += (uint32_t) 0; //external file attributes
-        global_header += (uint32_t) global_header_offset; //relative offset of local file header, since it begins where the global header used to begin
-        global_header += fname;
-
-        //build footer
-        std::vector<char> footer;
-        footer += "PK"; //first part of sig
-        footer += (uint16_t) 0x0605; //second part of sig
-        footer += (uint16_t) 0; //number of this disk
-        footer += (uint16_t) 0; //disk where footer starts
-        footer += (uint16_t) (nrecs+1); //number of records on this disk
-        footer += (uint16_t) (nrecs+1); //total number of records
-        footer += (uint32_t) global_header.size(); //nbytes of global headers
-        footer += (uint32_t) (global_header_offset + nbytes + local_header.size()); //offset of start of global headers, since global header now starts after newly written array
-        footer += (uint16_t) 0; //zip file comment length
-
-        //write everything
-        fwrite(&local_header[0],sizeof(char),local_header.size(),fp);
-        fwrite(&npy_header[0],sizeof(char),npy_header.size(),fp);
-        fwrite(data,sizeof(T),nels,fp);
-        fwrite(&global_header[0],sizeof(char),global_header.size(),fp);
-        fwrite(&footer[0],sizeof(char),footer.size(),fp);
-        fclose(fp);
+    //npz_dumps without copying the payload. data, and the data of members added before, must outlive archive
+    template<typename T> void npz_dumps_scatter(ScatterBuffer& archive, const std::string& fname, const T* data, const std::vector<size_t>& shape, const std::string& mode = "w", bool fortran_order = false) {
+        std::vector<char> npy_header = create_npy_header<T>(shape, fortran_order);
+        size_t nels = std::accumulate(shape.begin(),shape.end(),(size_t)1,std::multiplies<size_t>());
+        npz_add_member(archive, fname, npy_header, reinterpret_cast<const char*>(data), nels*sizeof(T), mode == "a" && !archive.segments.empty());
     }
 
-    template<typename T> void npy_save(std::string fname, const std::vector<T> data, std::string mode = "w", bool fortran_order = false) {
+    template<typename T> void npy_save(const std::string& fname, const std::vector<T>& data, const std::string& mode = "w", bool fortran_order = false, bool atomic = false) {
         std::vector<size_t> shape;
         shape.push_back(data.size());
-        npy_save(fname, &data[0], shape, mode, fortran_order);
+        npy_save(fname, &data[0], shape, mode, fortran_order, atomic);
     }
 
-    template<typename T> void npz_save(std::string zipname, std::string fname, const std::vector<T> data, std::string mode = "w", bool fortran_order = false) {
+    template<typename T> void npz_save(const std::string& zipname, const std::string& fname, const std::vector<T>& data, const std::string& mode = "w", bool fortran_order = false, bool atomic = false) {
         std::vector<size_t> shape;
         shape.push_back(data.size());
-        npz_save(zipname, fname, &data[0], shape, mode, fortran_order);
+        npz_save(zipname, fname, &data[0], shape, mode, fortran_order, atomic);
     }
 
     template<typename T> std::vector<char> create_npy_header(const std::vector<size_t>& shape, bool fortran_order) {
-        std::vector<char> dict;
-        dict += "{'descr': '";
-        dict += BigEndianTest();
-        dict += map_type(typeid(T));
-        dict += std::to_string(sizeof(T));
-        std::stringstream ss;
-        ss << "', 'fortran_order': ";
-        ss << (fortran_order ? "True": "False");
-        dict += ss.str().c_str();
-        dict += ", 'shape': (";
-        dict += std::to_string(shape[0]);
-        for(size_t i = 1;i < shape.size();i++) {
-            dict += ", ";
-            dict += std::to_string(shape[i]);
-        }
-        if(shape.size() == 1) dict += ",";
-        dict += "), }";
-        //pad with spaces so that preamble+dict is modulo 16 bytes. preamble is 10 bytes. dict needs to end with \n
-        int remainder = 16 - (10 + dict.size()) % 16;
-        dict.insert(dict.end(),remainder,' ');
-        dict.back() = '\n';
-
-        std::vector<char> header;
-        header += (char) 0x93;
-        header += "NUMPY";
-        header += (char) 0x01; //major version of numpy format
-        header += (char) 0x00; //minor version of numpy format
-        header += (uint16_t) dict.size();
-        header.insert(header.end(),dict.begin(),dict.end());
-
-        return header;
+        return create_npy_header(shape, map_type(typeid(T)), sizeof(T), fortran_order);
     }
 
 
@@ -0,0 +1,401 @@
+//throughput and latency benchmark for cnpy load/save paths.
+//run with --help for the options. results go to stdout as csv (default) or json lines.
+
+#include"cnpy.h"
+#include<algorithm>
+#include<chrono>
+#include<complex>
+#include<cstdlib>
+#include<cstring>
+#include<fstream>
+#include<iostream>
+#include<random>
+#include<string>
+#include<vector>
+#ifndef _WIN32
+#include<fcntl.h>
+#include<unistd.h>
+#endif
+
+namespace {
+
+struct Options {
+    size_t min_size = 4 << 10;
+    size_t max_size = 16 << 20;
+    size_t repeats = 5;
+    std::string format = "csv";
+    std::string dir = ".";
+    std::vector<std::string> dtypes = {"uint8", "int32", "float32", "float64", "complex128"};
+    std::vector<size_t> ranks = {1, 2, 3};
+    std::vector<bool> fortran_orders = {false, true};
+    bool cold = true;
+    bool deflate = true;
+};
+
+struct Result {
+    std::string op;
+    std::string dtype;
+    size_t rank;
+    bool fortran_order;
+    std::string codec;
+    std::string cache;
+    size_t bytes;
+    std::vector<double> seconds;
+    long peak_rss_kb;
+    double read_syscalls;
+    double write_syscalls;
+};
+
+//syscr/syscw from /proc/self/io, -1 where not available
+void syscall_counts(long& reads, long& writes) {
+    reads = writes = -1;
+    std::ifstream io("/proc/self/io");
+    std::string key;
+    long value;
+    while(io >> key >> value) {
+        if(key == "syscr:") reads = value;
+        if(key == "syscw:") writes = value;
+    }
+}
+
+//restart the kernel's peak RSS (VmHWM) from the current RSS, so the next reading covers only what ran since
+bool reset_peak_rss() {
+    std::ofstream clear_refs("/proc/self/clear_refs");
+    clear_refs << "5";
+    clear_refs.flush();
+    return clear_refs.good();
+}
+
+//VmHWM from /proc/self/status, -1 where not available
+long peak_rss_kb() {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while(std::getline(status, line)) {
+        if(line.compare(0, 6, "VmHWM:") == 0) return atol(line.c_str() + 6);
+    }
+    return -1;
+}
+
+//write back and drop a file from the page cache so the next read comes from storage
+void evict_from_page_cache(const std::string& fname) {
+#if defined(__linux__)
+    int fd = open(fname.c_str(), O_RDONLY);
+    if(fd < 0) return;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+#else
+    (void) fname;
+#endif
+}
+
+double percentile(std::vector<double> values, double p) {
+    std::sort(values.begin(), values.end());
+    size_t index = (size_t) (p * (values.size() - 1) + 0.5);
+    return values[std::min(index, values.size() - 1)];
+}
+
+//time op over opts.repeats runs, calling prepare (untimed) before each one
+template<typename Prepare, typename Op>
+Result measure(const Options& opts, Result result, Prepare prepare, Op op) {
+    long reads_before, writes_before, reads_after, writes_after;
+    //reading /proc/self/io costs syscalls itself, measure that once and take it out
+    syscall_counts(reads_before, writes_before);
+    syscall_counts(reads_after, writes_after);
+    long read_overhead = reads_after - reads_before, write_overhead = writes_after - writes_before;
+    long total_reads = 0, total_writes = 0;
+    result.peak_rss_kb = -1;
+    for(size_t i = 0; i < opts.repeats; i++) {
+        prepare();
+        bool peak_reset = reset_peak_rss();
+        syscall_counts(reads_before, writes_before);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        op();
+        std::chrono::steady_clock::time_point stop = std::chrono::steady_clock::now();
+        syscall_counts(reads_after, writes_after);
+        //without a reset the kernel only has the peak of the whole process, which says nothing about op
+        if(peak_reset) result.peak_rss_kb = std::max(result.peak_rss_kb, peak_rss_kb());
+        result.seconds.push_back(std::chrono::duration<double>(stop - start).count());
+        total_reads += reads_after - reads_before - read_overhead;
+        total_writes += writes_after - writes_before - write_overhead;
+    }
+    result.read_syscalls = reads_before < 0 ? -1 : (double) total_reads / opts.repeats;
+    result.write_syscalls = writes_before < 0 ? -1 : (double) total_writes / opts.repeats;
+    return result;
+}
+
+void print_result(const Options& opts, const Result& r) {
+    double p50 = percentile(r.seconds, 0.5), p90 = percentile(r.seconds, 0.9), p99 = percentile(r.seconds, 0.99);
+    double mb_per_s = p50 > 0 ? r.bytes / p50 / 1e6 : 0;
+    if(opts.format == "json") {
+        std::cout << "{\"op\": \"" << r.op << "\", \"dtype\": \"" << r.dtype << "\", \"rank\": " << r.rank
+                  << ", \"order\": \"" << (r.fortran_order ? "F" : "C") << "\", \"codec\": \"" << r.codec
+                  << "\", \"cache\": \"" << r.cache << "\", \"bytes\": " << r.bytes << ", \"repeats\": " << r.seconds.size()
+                  << ", \"mb_per_s\": " << mb_per_s << ", \"p50_ms\": " << p50 * 1e3 << ", \"p90_ms\": " << p90 * 1e3
+                  << ", \"p99_ms\": " << p99 * 1e3 << ", \"peak_rss_kb\": " << r.peak_rss_kb
+                  << ", \"read_syscalls\": " << r.read_syscalls << ", \"write_syscalls\": " << r.write_syscalls << "}\n";
+    } else {
+        std::cout << r.op << "," << r.dtype << "," << r.rank << "," << (r.fortran_order ? "F" : "C") << "," << r.codec << ","
+                  << r.cache << "," << r.bytes << "," << r.seconds.size() << "," << mb_per_s << "," << p50 * 1e3 << ","
+                  << p90 * 1e3 << "," << p99 * 1e3 << "," << r.peak_rss_kb << "," << r.read_syscalls << "," << r.write_syscalls << "\n";
+    }
+    std::cout.flush();
+}
+
+//split nels over rank dimensions, the leading dimension takes what does not divide evenly
+std::vector<size_t> make_shape(size_t nels, size_t rank) {
+    std::vector<size_t> shape(rank, 1);
+    size_t inner = 1;
+    for(size_t i = 1; i < rank; i++) {
+        shape[i] = 16;
+        inner *= 16;
+    }
+    shape[0] = std::max<size_t>(nels / inner, 1);
+    return shape;
+}
+
+//moderately compressible data, so the deflated codec has something to do
+template<typename T> std::vector<T> make_data(size_t nels) {
+    std::vector<T> data(nels);
+    std::mt19937 generator(1234);
+    for(size_t i = 0; i < nels; i++) data[i] = T((i % 1024) + (generator() % 8));
+    return data;
+}
+
+void append_u16(std::vector<char>& out, uint16_t value) { out.push_back(value & 0xff); out.push_back(value >> 8); }
+void append_u32(std::vector<char>& out, uint32_t value) { for(int i = 0; i < 4; i++) out.push_back((value >> (8*i)) & 0xff); }
+
+//single-member archive with a deflated member, as written by numpy.savez_compressed.
+//cnpy only writes stored members, so the benchmark builds these itself
+void write_deflated_npz(const std::string& zipname, const std::string& varname, const std::vector<char>& npy) {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+    std::vector<char> compressed(deflateBound(&stream, npy.size()));
+    stream.next_in = (Bytef*) npy.data();
+    stream.avail_in = npy.size();
+    stream.next_out = (Bytef*) compressed.data();
+    stream.avail_out = compressed.size();
+    deflate(&stream, Z_FINISH);
+    compressed.resize(stream.total_out);
+    deflateEnd(&stream);
+
+    uint32_t crc = crc32(0L, (const Bytef*) npy.data(), npy.size());
+    std::string member = varname + ".npy";
+    std::vector<char> local, central, footer;
+    local.insert(local.end(), {'P', 'K', 3, 4});
+    append_u16(local, 20);
+    append_u16(local, 0);
+    append_u16(local, 8); //deflate
+    append_u16(local, 0);
+    append_u16(local, 0);
+    append_u32(local, crc);
+    append_u32(local, compressed.size());
+    append_u32(local, npy.size());
+    append_u16(local, member.size());
+    append_u16(local, 0);
+    local.insert(local.end(), member.begin(), member.end());
+
+    central.insert(central.end(), {'P', 'K', 1, 2});
+    append_u16(central, 20);
+    central.insert(central.end(), local.begin() + 4, local.begin() + 30);
+    append_u16(central, 0);
+    append_u16(central, 0);
+    append_u16(central, 0);
+    append_u32(central, 0);
+    append_u32(central, 0);
+    central.insert(central.end(), member.begin(), member.end());
+
+    footer.insert(footer.end(), {'P', 'K', 5, 6});
+    append_u16(footer, 0);
+    append_u16(footer, 0);
+    append_u16(footer, 1);
+    append_u16(footer, 1);
+    append_u32(footer, central.size());
+    append_u32(footer, local.size() + compressed.size());
+    append_u16(footer, 0);
+
+    std::ofstream out(zipname.c_str(), std::ios::binary);
+    out.write(local.data(), local.size());
+    out.write(compressed.data(), compressed.size());
+    out.write(central.data(), central.size());
+    out.write(footer.data(), footer.size());
+}
+
+template<typename T>
+void run_config(const Options& opts, const std::string& dtype, size_t bytes, size_t rank, bool fortran_order) {
+    std::vector<size_t> shape = make_shape(std::max<size_t>(bytes / sizeof(T), 1), rank);
+    size_t nels = 1;
+    for(size_t i = 0; i < shape.size(); i++) nels *= shape[i];
+    std::vector<T> data = make_data<T>(nels);
+    size_t nbytes = nels * sizeof(T);
+    const T* ptr = data.data();
+    const std::string npy_file = opts.dir + "/cnpy_bench.npy";
+    const std::string npz_file = opts.dir + "/cnpy_bench.npz";
+    const std::string npz_deflated_file = opts.dir + "/cnpy_bench_deflated.npz";
+    const double small = 1.0;
+
+    Result base;
+    base.dtype = dtype;
+    base.rank = rank;
+    base.fortran_order = fortran_order;
+    base.codec = "stored";
+    base.cache = "warm";
+    base.bytes = nbytes;
+    auto nothing = [](){};
+
+    Result r = base;
+    r.op = "npy_save";
+    print_result(opts, measure(opts, r, nothing, [&]() { cnpy::npy_save(npy_file, ptr, shape, "w", fortran_order); }));
+
+    std::vector<std::string> caches = {"warm"};
+    if(opts.cold) caches.push_back("cold");
+
+    for(size_t c = 0; c < caches.size(); c++) {
+        bool cold = caches[c] == "cold";
+        r = base;
+        r.op = "npy_load";
+        r.cache = caches[c];
+        print_result(opts, measure(opts, r, [&]() { if(cold) evict_from_page_cache(npy_file); },
+            [&]() { cnpy::npy_load(npy_file); }));
+    }
+
+    r = base;
+    r.op = "npz_save_w";
+    print_result(opts, measure(opts, r, nothing, [&]() { cnpy::npz_save(npz_file, "data", ptr, shape, "w", fortran_order); }));
+
+    r = base;
+    r.op = "npz_save_a";
+    print_result(opts, measure(opts, r, [&]() { cnpy::npz_save(npz_file, "small", &small, {1}, "w"); },
+        [&]() { cnpy::npz_save(npz_file, "data", ptr, shape, "a", fortran_order); }));
+
+    //archive is now {small, data}: the single-variable load has to walk past the first member
+    for(size_t c = 0; c < caches.size(); c++) {
+        bool cold = caches[c] == "cold";
+        r = base;
+        r.cache = caches[c];
+        r.op = "npz_load_all";
+        print_result(opts, measure(opts, r, [&]() { if(cold) evict_from_page_cache(npz_file); },
+            [&]() { cnpy::npz_load(npz_file); }));
+        r.op = "npz_load_var";
+        print_result(opts, measure(opts, r, [&]() { if(cold) evict_from_page_cache(npz_file); },
+            [&]() { cnpy::npz_load(npz_file, "data"); }));
+    }
+
+    if(opts.deflate) {
+        write_deflated_npz(npz_deflated_file, "data", cnpy::npy_dumps(ptr, shape, fortran_order));
+        for(size_t c = 0; c < caches.size(); c++) {
+            bool cold = caches[c] == "cold";
+            r = base;
+            r.codec = "deflate";
+            r.cache = caches[c];
+            r.op = "npz_load_all";
+            print_result(opts, measure(opts, r, [&]() { if(cold) evict_from_page_cache(npz_deflated_file); },
+                [&]() { cnpy::npz_load(npz_deflated_file); }));
+            r.op = "npz_load_var";
+            print_result(opts, measure(opts, r, [&]() { if(cold) evict_from_page_cache(npz_deflated_file); },
+                [&]() { cnpy::npz_load(npz_deflated_file, "data"); }));
+        }
+    }
+
+    remove(npy_file.c_str());
+    remove(npz_file.c_str());
+    remove(npz_deflated_file.c_str());
+}
+
+//sizes like 4096, 64K, 16M, 2G
+size_t parse_size(const std::string& text) {
+    char* end = NULL;
+    double value = strtod(text.c_str(), &end);
+    switch(*end) {
+        case 'k': case 'K': value *= 1024.0; break;
+        case 'm': case 'M': value *= 1024.0 * 1024; break;
+        case 'g': case 'G': value *= 1024.0 * 1024 * 1024; break;
+        default: break;
+    }
+    return (size_t) value;
+}
+
+std::vector<std::string> split(const std::string& text) {
+    std::vector<std::string> parts;
+    std::string part;
+    for(size_t i = 0; i <= text.size(); i++) {
+        if(i == text.size() || text[i] == ',') {
+            if(!part.empty()) parts.push_back(part);
+            part.clear();
+        } else {
+            part += text[i];
+        }
+    }
+    return parts;
+}
+
+void usage() {
+    std::cerr << "usage: cnpy_bench [options]\n"
+              << "  --min-size SIZE     smallest payload, e.g. 4K (default 4K)\n"
+              << "  --max-size SIZE     largest payload, sizes grow by 4x (default 16M)\n"
+              << "  --repeats N         timed runs per measurement (default 5)\n"
+              << "  --dtypes LIST       comma separated from uint8,int32,float32,float64,complex128\n"
+              << "  --ranks LIST        comma separated ranks (default 1,2,3)\n"
+              << "  --orders LIST       C, F or C,F (default C,F)\n"
+              << "  --no-cold           skip page-cache-cold load runs\n"
+              << "  --no-deflate        skip deflated npz loads\n"
+              << "  --format csv|json   output format (default csv)\n"
+              << "  --dir PATH          directory for the scratch files (default .)\n";
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    Options opts;
+    for(int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        std::string value = i + 1 < argc ? argv[i + 1] : "";
+        if(arg == "--min-size") { opts.min_size = parse_size(value); i++; }
+        else if(arg == "--max-size") { opts.max_size = parse_size(value); i++; }
+        else if(arg == "--repeats") { opts.repeats = std::max(1, atoi(value.c_str())); i++; }
+        else if(arg == "--format") { opts.format = value; i++; }
+        else if(arg == "--dir") { opts.dir = value; i++; }
+        else if(arg == "--dtypes") { opts.dtypes = split(value); i++; }
+        else if(arg == "--ranks") {
+            opts.ranks.clear();
+            std::vector<std::string> ranks = split(value);
+            for(size_t r = 0; r < ranks.size(); r++) opts.ranks.push_back(std::max(1, atoi(ranks[r].c_str())));
+            i++;
+        }
+        else if(arg == "--orders") {
+            opts.fortran_orders.clear();
+            std::vector<std::string> orders = split(value);
+            for(size_t o = 0; o < orders.size(); o++) opts.fortran_orders.push_back(orders[o] == "F");
+            i++;
+        }
+        else if(arg == "--no-cold") opts.cold = false;
+        else if(arg == "--no-deflate") opts.deflate = false;
+        else { usage(); return arg == "--help" ? 0 : 1; }
+    }
+
+    if(opts.format != "json")
+        std::cout << "op,dtype,rank,order,codec,cache,bytes,repeats,mb_per_s,p50_ms,p90_ms,p99_ms,peak_rss_kb,read_syscalls,write_syscalls\n";
+
+    for(size_t bytes = std::max<size_t>(opts.min_size, 1); bytes <= opts.max_size; bytes *= 4) {
+        for(size_t d = 0; d < opts.dtypes.size(); d++) {
+            for(size_t r = 0; r < opts.ranks.size(); r++) {
+                for(size_t o = 0; o < opts.fortran_orders.size(); o++) {
+                    const std::string& dtype = opts.dtypes[d];
+                    size_t rank = opts.ranks[r];
+                    bool fortran_order = opts.fortran_orders[o];
+                    if(dtype == "uint8") run_config<uint8_t>(opts, dtype, bytes, rank, fortran_order);
+                    else if(dtype == "int32") run_config<int32_t>(opts, dtype, bytes, rank, fortran_order);
+                    else if(dtype == "float32") run_config<float>(opts, dtype, bytes, rank, fortran_order);
+                    else if(dtype == "float64") run_config<double>(opts, dtype, bytes, rank, fortran_order);
+                    else if(dtype == "complex128") run_config<std::complex<double>>(opts, dtype, bytes, rank, fortran_order);
+                    else {
+                        std::cerr << "cnpy_bench: unknown dtype " << dtype << "\n";
+                        return 1;
+                    }
+                }
+            }
+        }
+    }
+    return 0;
+}
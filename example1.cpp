@@ -43,6 +43,21 @@ int main()
     assert(arr.dtype == cnpy::NPY_CDOUBLE);
     for(int i = 0; i < Nx*Ny*Nz;i++) assert(data[i] == loaded_data[i]);
 
+    //write the same data with several threads, using small chunks so every thread gets work
+    cnpy::ParallelWriteOptions parallel_options;
+    parallel_options.num_threads = 4;
+    parallel_options.chunk_size = 64 * 1024;
+    size_t reported_bytes = 0;
+    parallel_options.progress = [&](size_t bytes_written, size_t total_bytes, double) {
+        assert(bytes_written > reported_bytes && bytes_written <= total_bytes);
+        reported_bytes = bytes_written;
+    };
+    cnpy::npy_save_parallel("arr1_parallel.npy", &data[0], {Nz, Ny, Nx}, false, parallel_options);
+    cnpy::NpyArray arr_parallel = cnpy::npy_load("arr1_parallel.npy");
+    assert(arr_parallel.shape == arr.shape && arr_parallel.num_bytes() == arr.num_bytes());
+    assert(reported_bytes > arr.num_bytes());
+    for(int i = 0; i < Nx*Ny*Nz;i++) assert(data[i] == arr_parallel.data<std::complex<double>>()[i]);
+
     //append the same data to file
     //npy array on file now has shape (Nz+Nz,Ny,Nx)
     cnpy::npy_save("arr1.npy", &data[0], {Nz, Ny, Nx}, "a", false);
@@ -71,6 +86,101 @@ int main()
     assert(mv1[0] == myVar1);
     assert(arr_mv1.dtype == cnpy::NPY_DOUBLE);
 
+    //every member of the archive is loaded
+    assert(my_npz.size() == 3 && my_npz["arr1"].num_bytes() == data.size()*sizeof(data[0]));
+    assert(my_npz["myVar2"].data<char>()[0] == myVar2);
+
+    //serialize to memory and load back without copying
+    std::vector<char> npy_bytes = cnpy::npy_dumps(&data[0], {Nz, Ny, Nx});
+    cnpy::NpyArray arr_view = cnpy::npy_loads(npy_bytes.data(), npy_bytes.size());
+    assert(arr_view.shape == arr.shape && arr_view.dtype == cnpy::NPY_CDOUBLE && !arr_view.data_holder);
+    assert(arr_view.data<char>() >= npy_bytes.data() && arr_view.data<char>() < npy_bytes.data() + npy_bytes.size());
+    for(int i = 0; i < Nx*Ny*Nz;i++) assert(data[i] == arr_view.data<std::complex<double>>()[i]);
+    cnpy::ScatterBuffer npy_segments = cnpy::npy_dumps_scatter(&data[0], {Nz, Ny, Nx});
+    assert(npy_segments.segments.size() == 2 && npy_segments.num_bytes() == npy_bytes.size());
+    assert(npy_segments.segments[1].first == reinterpret_cast<const char*>(&data[0]));
+
+    std::vector<char> npz_bytes;
+    cnpy::npz_dumps(npz_bytes,"myVar1",&myVar1,{1},"w");
+    cnpy::npz_dumps(npz_bytes,"arr1",&data[0],{Nz,Ny,Nx},"a");
+    cnpy::npz_t npz_from_bytes = cnpy::npz_loads(npz_bytes.data(), npz_bytes.size());
+    assert(npz_from_bytes.size() == 2 && npz_from_bytes["myVar1"].data<double>()[0] == myVar1);
+    cnpy::NpyArray arr1_from_bytes = cnpy::npz_loads(npz_bytes.data(), npz_bytes.size(), "arr1", true);
+    for(int i = 0; i < Nx*Ny*Nz;i++) assert(data[i] == arr1_from_bytes.data<std::complex<double>>()[i]);
+    cnpy::NpyArray arr1_view = cnpy::npz_loads(npz_bytes.data(), npz_bytes.size(), "arr1");
+    assert(arr1_view.shape == arr.shape && arr1_view.data<char>() > npz_bytes.data());
+    std::shared_ptr<std::vector<char>> npz_owned = std::make_shared<std::vector<char>>(npz_bytes);
+    cnpy::npz_t npz_shared_bytes = cnpy::npz_loads(npz_owned->data(), npz_owned->size(), npz_owned);
+    assert(npz_owned.use_count() == 3 && npz_shared_bytes["arr1"].data<char>() > npz_owned->data());
+
+    //the same archive with the payloads referenced in place
+    cnpy::ScatterBuffer npz_segments;
+    cnpy::npz_dumps_scatter(npz_segments,"myVar1",&myVar1,{1},"w");
+    cnpy::npz_dumps_scatter(npz_segments,"arr1",&data[0],{Nz,Ny,Nx},"a");
+    assert(npz_segments.num_bytes() == npz_bytes.size());
+    std::vector<char> npz_gathered;
+    for(size_t i = 0; i < npz_segments.segments.size(); i++)
+        npz_gathered.insert(npz_gathered.end(), npz_segments.segments[i].first, npz_segments.segments[i].first + npz_segments.segments[i].second);
+    assert(npz_gathered == npz_bytes);
+
+    //publish the archive into shared memory and attach to it again
+    cnpy::shm_publish("cnpy_example1", npz_from_bytes);
+    cnpy::npz_t npz_shared = cnpy::shm_attach("cnpy_example1");
+    cnpy::shm_remove("cnpy_example1");
+    assert(npz_shared.size() == 2 && npz_shared["myVar1"].data<double>()[0] == myVar1);
+    assert(npz_shared["arr1"].shape == arr.shape && npz_shared["arr1"].dtype == cnpy::NPY_CDOUBLE);
+    for(int i = 0; i < Nx*Ny*Nz;i++) assert(data[i] == npz_shared["arr1"].data<std::complex<double>>()[i]);
+
+    //cached loads are answered from memory until the file changes
+    cnpy::cache_set_capacity(size_t(64) << 20);
+    cnpy::NpyArray cached1 = cnpy::npz_load_cached("out.npz", "arr1");
+    cnpy::NpyArray cached2 = cnpy::npz_load_cached("out.npz", "arr1");
+    assert(cached1.data<char>() == cached2.data<char>() && cnpy::cache_stats().hits == 1);
+    cnpy::npz_save("out.npz","myVar3",&myVar1,{1},"a");
+    cnpy::NpyArray cached3 = cnpy::npz_load_cached("out.npz", "arr1");
+    assert(cached3.data<char>() != cached1.data<char>() && cnpy::cache_stats().hits == 1);
+    cnpy::cache_set_capacity(0);
+    assert(cnpy::cache_stats().entries == 0 && cnpy::cache_stats().bytes == 0);
+
+    //time the phases of a save and a load
+    std::map<std::string, size_t> phase_events;
+    cnpy::metrics_set_callback([&](const cnpy::MetricsEvent& event) {
+        if(event.path) phase_events[cnpy::metrics_phase_name(event.phase)]++;
+    });
+    cnpy::metrics_reset();
+    cnpy::metrics_enable(true);
+    cnpy::npz_save("out_metrics.npz","arr1",&data[0],{Nz,Ny,Nx},"w");
+    cnpy::npz_load("out_metrics.npz","arr1");
+    cnpy::npy_load("arr1_parallel.npy");
+    cnpy::metrics_enable(false);
+    cnpy::metrics_set_callback(nullptr);
+    cnpy::MetricsSnapshot metrics = cnpy::metrics_snapshot();
+    if(metrics.phases[cnpy::PHASE_READ].calls > 0) {
+        //built with ENABLE_METRICS
+        assert(metrics.phases[cnpy::PHASE_CRC].bytes > data.size()*sizeof(data[0]));
+        assert(metrics.phases[cnpy::PHASE_READ].bytes >= data.size()*sizeof(data[0]));
+        assert(phase_events["open"] == 3 && phase_events["header_parse"] == 2 && phase_events["read"] == 2);
+    }
+
+    //atomic saves go through a temporary file that is synced and renamed over the target
+    cnpy::npy_save("arr1_atomic.npy", &data[0], {Nz, Ny, Nx}, "w", false, true);
+    cnpy::npy_save("arr1_atomic.npy", &data[0], {Nz, Ny, Nx}, "a", false, true);
+    cnpy::NpyArray arr_atomic = cnpy::npy_load("arr1_atomic.npy");
+    assert(arr_atomic.shape.size() == 3 && arr_atomic.shape[0] == 2*Nz);
+    for(int i = 0; i < Nx*Ny*Nz;i++) assert(data[i] == arr_atomic.data<std::complex<double>>()[Nx*Ny*Nz + i]);
+    //a plain append whose header grows (96 to 112 bytes here) rewrites the file without losing the old rows
+    std::vector<int> grow_rows(10 * 100);
+    for(size_t i = 0; i < grow_rows.size(); i++) grow_rows[i] = (int) i;
+    cnpy::npy_save("arr_header_grows.npy", &grow_rows[0], {9, 1, 1, 1, 1, 1, 1, 1, 1, 100});
+    cnpy::npy_save("arr_header_grows.npy", &grow_rows[900], {1, 1, 1, 1, 1, 1, 1, 1, 1, 100}, "a");
+    cnpy::NpyArray header_grows = cnpy::npy_load("arr_header_grows.npy");
+    assert(header_grows.shape[0] == 10 && header_grows.as_vec<int>() == grow_rows);
+    cnpy::npz_save("out_atomic.npz","myVar1",&myVar1,{1},"w",false,true);
+    cnpy::npz_save("out_atomic.npz","arr1",&data[0],{Nz,Ny,Nx},"a",false,true);
+    cnpy::NpyArray arr1_atomic = cnpy::npz_load("out_atomic.npz","arr1");
+    assert(arr1_atomic.num_bytes() == data.size()*sizeof(data[0]));
+    assert(cnpy::npz_load("out_atomic.npz","myVar1").data<double>()[0] == myVar1);
+
     //create random int64_t data
     std::vector<int64_t> data_int64_t(Nx*Ny*Nz);
     std::mt19937_64 random_generator(12345);
@@ -124,6 +234,102 @@ int main()
     assert(arr_int64_t_fortran2.fortran_order == true);
     for(int i = 0; i < fortran_column_count * fortran_row_count; i++) assert(data_int64_t_fortran[i] == loaded_data_int64_t_fortran2[i]);
 
+    //metadata from the headers alone
+    cnpy::NpyInfo arr1_info = cnpy::npy_info("arr1.npy");
+    assert(arr1_info.num_bytes == 2*data.size()*sizeof(data[0]) && arr1_info.compressed_bytes == arr1_info.data_offset + arr1_info.num_bytes);
+    assert(arr1_info.num_bytes == 2*data.size()*sizeof(data[0]));
+    std::vector<cnpy::NpyInfo> compressed_infos = cnpy::npz_list("body_region_points_c.npz");
+    assert(compressed_infos.size() == 4 && compressed_infos[0].name == "chest" && compressed_infos[0].compressed);
+    std::vector<cnpy::ScanResult> scanned = cnpy::scan_directory(".", false, 2);
+    for(size_t i = 0; i < scanned.size(); i++) {
+        if(scanned[i].path != "./body_region_points.npz") continue;
+        assert(scanned[i].error.empty() && scanned[i].arrays.size() == 4 && !scanned[i].arrays[0].compressed);
+        for(size_t a = 0; a < 4; a++) {
+            assert(scanned[i].arrays[a].shape == compressed_infos[a].shape && scanned[i].arrays[a].dtype == cnpy::NPY_INT);
+            assert(scanned[i].arrays[a].num_bytes == cnpy::npz_load("body_region_points.npz", scanned[i].arrays[a].name).num_bytes());
+        }
+    }
+
+    //three shards of a (row, 4) table seen as one dataset
+    std::vector<int> table(60 * 4);
+    for(size_t i = 0; i < table.size(); i++) table[i] = (int) i;
+    cnpy::npy_save("shard0.npy", &table[0], {10, 4});
+    cnpy::npy_save("shard1.npy", &table[10 * 4], {30, 4});
+    cnpy::npy_save("shard2.npy", &table[40 * 4], {20, 4});
+    cnpy::npz_save("shards.npz", "a", &table[0], {25, 4});
+    cnpy::npz_save("shards.npz", "b", &table[25 * 4], {35, 4}, "a");
+    cnpy::NpyDataset dataset = cnpy::NpyDataset::from_npy_files({"shard0.npy", "shard1.npy", "shard2.npy"});
+    cnpy::NpyDataset npz_dataset = cnpy::NpyDataset::from_npz("shards.npz");
+    assert(dataset.num_rows() == 60 && dataset.row_bytes() == 4 * sizeof(int) && dataset.num_shards() == 3);
+    std::vector<size_t> batch_rows = {59, 3, 4, 5, 9, 10, 33, 3, 0, 41};
+    dataset.prefetch(batch_rows);
+    cnpy::NpyArray batch = dataset.gather(batch_rows);
+    cnpy::NpyArray npz_batch = npz_dataset.gather(batch_rows);
+    assert(batch.shape.size() == 2 && batch.shape[0] == batch_rows.size() && batch.shape[1] == 4);
+    for(size_t r = 0; r < batch_rows.size(); r++) {
+        for(size_t c = 0; c < 4; c++) {
+            assert(batch.data<int>()[r * 4 + c] == table[batch_rows[r] * 4 + c]);
+            assert(npz_batch.data<int>()[r * 4 + c] == table[batch_rows[r] * 4 + c]);
+        }
+    }
+    cnpy::NpyArray shard_view = dataset.view(12, 40);
+    assert(shard_view.shape[0] == 28 && shard_view.data<int>()[0] == table[12 * 4]);
+
+    //save column 1 of the table and its transpose straight from strided views
+    cnpy::npy_save_strided("table_column.npy", &table[1], {60}, {4 * sizeof(int)});
+    cnpy::npy_save_strided("table_column.npy", &table[1], {60}, {4 * sizeof(int)}, "a");
+    cnpy::npz_save_strided("table_views.npz", "transposed", &table[0], {4, 60}, {sizeof(int), 4 * sizeof(int)});
+    cnpy::npz_save_strided("table_views.npz", "reversed_rows", &table[59 * 4], {60, 4}, {-(ptrdiff_t) (4 * sizeof(int)), sizeof(int)}, "a");
+    cnpy::NpyArray table_column = cnpy::npy_load("table_column.npy");
+    cnpy::NpyArray transposed = cnpy::npz_load("table_views.npz", "transposed");
+    cnpy::NpyArray reversed_rows = cnpy::npz_load("table_views.npz", "reversed_rows");
+    assert(table_column.shape[0] == 120 && transposed.shape[0] == 4 && transposed.shape[1] == 60);
+    for(size_t r = 0; r < 60; r++) {
+        assert(table_column.data<int>()[r] == table[r * 4 + 1] && table_column.data<int>()[60 + r] == table[r * 4 + 1]);
+        for(size_t c = 0; c < 4; c++) {
+            assert(transposed.data<int>()[c * 60 + r] == table[r * 4 + c]);
+            assert(reversed_rows.data<int>()[r * 4 + c] == table[(59 - r) * 4 + c]);
+        }
+    }
+
+    //edit an archive: replace members in place or by appending, remove one, then reclaim the dead bytes
+    std::vector<double> small(10, 1.0), large(1000, 2.0);
+    cnpy::npz_save("edited.npz", "a", &small[0], {10});
+    cnpy::npz_save("edited.npz", "b", &large[0], {1000}, "a");
+    cnpy::npz_save("edited.npz", "c", &small[0], {10}, "a");
+    cnpy::npz_save("edited.npz", "b", &large[0], {500}, "a"); //duplicate name
+    cnpy::npz_replace("edited.npz", "b", &small[0], {10}); //fits where the first b was
+    cnpy::npz_replace("edited.npz", "a", &large[0], {1000}); //does not fit, appended
+    cnpy::npz_remove("edited.npz", "c");
+    std::vector<cnpy::NpyInfo> edited_members = cnpy::npz_list("edited.npz");
+    assert(edited_members.size() == 2 && edited_members[0].name == "a" && edited_members[1].name == "b");
+    //loads go by the central directory, so the dropped copies are invisible before compaction
+    cnpy::npz_t edited_before = cnpy::npz_load("edited.npz");
+    assert(edited_before.size() == 2 && edited_before["a"].as_vec<double>() == large && edited_before["b"].as_vec<double>() == small);
+    assert(cnpy::npz_load("edited.npz", "a").shape[0] == 1000 && cnpy::npz_load("edited.npz", "b").shape[0] == 10);
+    bool removed_loads = true;
+    try { cnpy::npz_load("edited.npz", "c"); } catch(const std::runtime_error&) { removed_loads = false; }
+    assert(!removed_loads);
+    assert(cnpy::npz_compact("edited.npz") > 1000 * sizeof(double));
+    cnpy::npz_t edited = cnpy::npz_load("edited.npz");
+    assert(edited.size() == 2 && edited["a"].shape[0] == 1000 && edited["b"].shape[0] == 10);
+    assert(edited["a"].as_vec<double>() == large && edited["b"].as_vec<double>() == small);
+    assert(cnpy::npz_compact("edited.npz", true) == 0);
+
+    //fixed width byte and unicode string arrays
+    std::vector<std::string> labels = {"cat", "", "zebra crossing", "\xc3\xa9t\xc3\xa9", "\xe2\x82\xac 10", "\xf0\x9f\x90\x88", "a much longer ascii label"};
+    cnpy::npy_save_strings("labels_S.npy", {"cat", "", "zebra crossing"});
+    cnpy::npy_save_strings("labels_S.npy", {"dog"}, cnpy::NPY_STRING, "a");
+    cnpy::npy_save_strings("labels_U.npy", labels, cnpy::NPY_UNICODE);
+    cnpy::npz_save_strings("labels.npz", "labels", labels, cnpy::NPY_UNICODE);
+    cnpy::NpyArray labels_S = cnpy::npy_load("labels_S.npy");
+    cnpy::NpyArray labels_U = cnpy::npy_load("labels_U.npy");
+    assert(labels_S.dtype == cnpy::NPY_STRING && labels_S.word_size == 14 && labels_S.shape[0] == 4);
+    assert(labels_S.string_at(1) == "" && labels_S.string_at(3) == "dog" && labels_S.as_strings()[2] == "zebra crossing");
+    assert(labels_U.dtype == cnpy::NPY_UNICODE && labels_U.word_size == 4 * labels.back().size());
+    assert(labels_U.as_strings() == labels && cnpy::npz_load("labels.npz", "labels").as_strings() == labels);
+    assert(cnpy::npy_info("labels_U.npy").num_bytes == labels.size() * labels_U.word_size);
+
     //     load 4 arrays from a tricky npz archive w/ zip64 format
     cnpy::NpyArray chest = cnpy::npz_load("body_region_points.npz", "chest");
     assert(chest.dtype == cnpy::NPY_INT);